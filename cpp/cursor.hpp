@@ -0,0 +1,232 @@
+#pragma once
+
+#include "types.hpp"
+#include "vt100.hpp"
+
+#include <algorithm>
+#include <string_view>
+
+namespace dpsg::vt100 {
+
+namespace detail {
+// CSI, then `value` unless it's the default of 1, then `final`
+constexpr char *render_move(char *out, u32 value, char final) noexcept {
+  *out++ = '\033';
+  *out++ = '[';
+  if (value != 1) {
+    out = render_code(out, value);
+  }
+  *out++ = final;
+  return out;
+}
+
+constexpr char *render_repeated(char *out, char c, u32 count) noexcept {
+  return std::fill_n(out, count, c);
+}
+} // namespace detail
+
+// Tracks the position of the terminal cursor, and moves it with the fewest
+// bytes: CUP (set_cursor) anywhere, CR to the first column, BS or CUB/CUF to
+// the left or right, CUU/CUD up or down, CHA and VPA to an absolute column or
+// row, or CR then LF to the start of a line below. Moves are cheap to find,
+// a handful of candidates are rendered and compared.
+//
+// The position is unknown until the first move, which is always absolute.
+// After text is written the cursor must be told with advance(). A write to
+// the last column leaves the cursor there with a line wrap pending, which
+// terminals handle differently, so only absolute moves are used from there.
+class cursor_planner {
+public:
+  // Longest sequence moving the cursor
+  constexpr static inline size_t max_move_size = 32;
+
+  constexpr explicit cursor_planner(u16 columns) noexcept
+      : columns_{columns} {}
+
+  // Forget the position, e.g. after something else wrote to the terminal
+  constexpr void invalidate() noexcept { y_ = unknown; }
+
+  [[nodiscard]] constexpr bool known() const noexcept { return y_ != unknown; }
+  // Only meaningful if known(), columns when a line wrap is pending
+  [[nodiscard]] constexpr u16 x() const noexcept { return x_; }
+  [[nodiscard]] constexpr u16 y() const noexcept { return y_; }
+
+  // Bytes needed to move to (x, y), 0-based
+  [[nodiscard]] constexpr size_t cost(u16 x, u16 y) const noexcept {
+    char buffer[max_move_size];
+    return static_cast<size_t>(plan(buffer, x, y) - buffer);
+  }
+
+  // Move to (x, y), 0-based, writing to `out`
+  template <class Sink> constexpr void move(Sink &out, u16 x, u16 y) {
+    char buffer[max_move_size];
+    const char *end = plan(buffer, x, y);
+    if (end != buffer) {
+      out << std::string_view{buffer, static_cast<size_t>(end - buffer)};
+    }
+    x_ = x;
+    y_ = y;
+  }
+
+  // The cursor moved `count` columns to the right by writing text
+  constexpr void advance(u16 count) noexcept {
+    x_ = static_cast<u16>(std::min<u32>(u32{x_} + count, columns_));
+  }
+
+private:
+  constexpr static inline u16 unknown = 0xFFFF;
+
+  u16 columns_;
+  u16 x_ = 0; // columns_ when a wrap is pending
+  u16 y_ = unknown;
+
+  // Longest run of BS or LF worth considering
+  constexpr static inline u16 max_repeat = 8;
+
+  // A candidate sequence
+  struct candidate {
+    char data[max_move_size];
+    size_t size = 0;
+
+    // Replace the sequence with the one written by `render` if it's shorter
+    template <class F> constexpr void keep_shorter(F render) noexcept {
+      char other[max_move_size];
+      const auto other_size = static_cast<size_t>(render(other) - other);
+      if (size == 0 || other_size < size) {
+        std::copy_n(other, other_size, data);
+        size = other_size;
+      }
+    }
+  };
+
+  // Write the cheapest move to (x, y) to `out`, returns its end
+  constexpr char *plan(char *out, u16 x, u16 y) const noexcept {
+    if (known() && x == x_ && y == y_) {
+      return out;
+    }
+
+    candidate best;
+    best.keep_shorter([&](char *o) { // CUP, without parameters that are 1
+      *o++ = '\033';
+      *o++ = '[';
+      if (y != 0 || x != 0) {
+        o = detail::render_code(o, y + 1u);
+      }
+      if (x != 0) {
+        *o++ = ';';
+        o = detail::render_code(o, x + 1u);
+      }
+      *o++ = 'H';
+      return o;
+    });
+    if (!known()) {
+      return std::copy_n(best.data, best.size, out);
+    }
+
+    candidate vertical; // Keeping the column
+    if (y != y_) {
+      vertical.keep_shorter(
+          [&](char *o) { return detail::render_move(o, y + 1u, 'd'); });
+      vertical.keep_shorter([&](char *o) {
+        return y < y_ ? detail::render_move(o, y_ - y, 'A')
+                      : detail::render_move(o, y - y_, 'B');
+      });
+    }
+    candidate horizontal; // Keeping the row
+    if (x != x_) {
+      horizontal.keep_shorter(
+          [&](char *o) { return detail::render_move(o, x + 1u, 'G'); });
+      if (x == 0) {
+        horizontal.keep_shorter([](char *o) {
+          *o++ = '\r';
+          return o;
+        });
+      }
+      if (x_ < columns_ && x < x_) {
+        horizontal.keep_shorter(
+            [&](char *o) { return detail::render_move(o, x_ - x, 'D'); });
+        if (x_ - x <= max_repeat) {
+          horizontal.keep_shorter([&](char *o) {
+            return detail::render_repeated(o, '\b', x_ - x);
+          });
+        }
+      } else if (x_ < columns_) {
+        horizontal.keep_shorter(
+            [&](char *o) { return detail::render_move(o, x - x_, 'C'); });
+      }
+    }
+    best.keep_shorter([&](char *o) {
+      o = std::copy_n(vertical.data, vertical.size, o);
+      return std::copy_n(horizontal.data, horizontal.size, o);
+    });
+
+    // Start of a line below: LF moves down whether or not the terminal adds
+    // a CR to it
+    if (x == 0 && y > y_ && y - y_ <= max_repeat) {
+      best.keep_shorter([&](char *o) {
+        if (x_ != 0) {
+          *o++ = '\r';
+        }
+        return detail::render_repeated(o, '\n', y - y_);
+      });
+    }
+    return std::copy_n(best.data, best.size, out);
+  }
+};
+
+namespace detail {
+// Sink keeping the last move written to it, for the checks below
+struct last_move {
+  rendered_termcode<cursor_planner::max_move_size> sequence;
+
+  constexpr last_move &operator<<(std::string_view move) noexcept {
+    sequence.size = static_cast<size_t>(
+        std::copy(move.begin(), move.end(), sequence.data) - sequence.data);
+    return *this;
+  }
+};
+
+// First move of a planner for `columns` columns, from an unknown position
+constexpr rendered_termcode<cursor_planner::max_move_size>
+first_move(u16 columns, u16 x, u16 y) noexcept {
+  cursor_planner cursor{columns};
+  last_move out;
+  cursor.move(out, x, y);
+  return out.sequence;
+}
+
+// Move to (x, y) after writing `written` characters from (from_x, from_y)
+constexpr rendered_termcode<cursor_planner::max_move_size>
+planned_move(u16 columns, u16 from_x, u16 from_y, u16 written, u16 x,
+             u16 y) noexcept {
+  cursor_planner cursor{columns};
+  last_move out;
+  cursor.move(out, from_x, from_y);
+  cursor.advance(written);
+  out.sequence.size = 0;
+  cursor.move(out, x, y);
+  return out.sequence;
+}
+} // namespace detail
+
+// From an unknown position, CUP without the parameters that are 1
+static_assert(detail::first_move(80, 0, 0).view() == "\033[H");
+static_assert(detail::first_move(80, 0, 4).view() == "\033[5H");
+static_assert(detail::first_move(80, 9, 0).view() == "\033[1;10H");
+static_assert(detail::first_move(1000, 299, 499).view() == "\033[500;300H");
+// Nothing to do
+static_assert(detail::planned_move(80, 5, 5, 0, 5, 5).view().empty());
+// Relative moves, the shortest one wins
+static_assert(detail::planned_move(80, 70, 3, 9, 75, 3).view() == "\033[4D");
+static_assert(detail::planned_move(80, 70, 3, 0, 68, 3).view() == "\b\b");
+static_assert(detail::planned_move(80, 10, 13, 0, 10, 11).view() == "\033[2A");
+// A wrap is pending after writing to the last column: absolute moves only
+static_assert(detail::planned_move(80, 70, 3, 10, 75, 3).view() == "\033[76G");
+static_assert(detail::planned_move(80, 70, 3, 10, 0, 4).view() == "\r\n");
+// CR then LF to the start of a line below, CR only if needed
+static_assert(detail::planned_move(80, 10, 3, 0, 0, 5).view() == "\r\n\n");
+static_assert(detail::planned_move(80, 0, 3, 0, 0, 5).view() == "\n\n");
+// Too far below for LFs
+static_assert(detail::planned_move(80, 0, 3, 0, 0, 20).view() == "\033[21H");
+
+} // namespace dpsg::vt100
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "linux_term.hpp"
+#include "spsc_ring.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+
+extern "C" {
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+namespace dpsg {
+
+// Reads and parses the terminal of a context on a thread of its own, so that
+// input keeps flowing while the thread consuming events is busy, e.g.
+// rendering a frame. Events are handed over through a lock-free ring that
+// the consumer drains with poll() without any system call. Only when the
+// consumer runs out of events and waits for more does the input thread wake
+// it up, through an eventfd.
+//
+// While the input thread runs it owns the context: the consumer must not use
+// its streams, pasted_text() or cursor queries. The texts of paste events and
+// cursor positions are available from the input thread instead.
+template <int Mode, class Parser, class Latency, size_t Capacity = 4096>
+class input_thread {
+public:
+  using context_type = raw_mode_context_basic<Mode, Parser, Latency>;
+
+  explicit input_thread(context_type &context,
+                        int escape_timeout = default_escape_timeout)
+      : context_{context}, escape_timeout_{escape_timeout},
+        wakeup_fd_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)},
+        stop_fd_{eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)} {
+    if (wakeup_fd_ == -1 || stop_fd_ == -1) {
+      const int error = errno;
+      close_fds();
+      errno = error;
+      throw errno_exception{};
+    }
+    thread_ = std::thread{[this] { run(); }};
+  }
+
+  input_thread(const input_thread &) = delete;
+  input_thread &operator=(const input_thread &) = delete;
+  input_thread(input_thread &&) = delete;
+  input_thread &operator=(input_thread &&) = delete;
+
+  ~input_thread() noexcept {
+    stopping_.store(true);
+    drained_.fetch_add(1);
+    drained_.notify_one(); // In case it waits for room in the ring
+    const u64 one = 1;
+    [[maybe_unused]] auto _ = write(stop_fd_, &one, sizeof(one));
+    thread_.join();
+    close_fds();
+  }
+
+  // Move the events available right now to `out`, without blocking or
+  // making any system call. Returns the number of events written.
+  size_t poll(std::span<event> out) {
+    const size_t count = ring_.pop(out);
+    if (count != 0) {
+      drained_.fetch_add(1, std::memory_order_release);
+      drained_.notify_one();
+    } else if (!running_.load(std::memory_order_acquire) && error_) {
+      std::rethrow_exception(std::exchange(error_, nullptr));
+    }
+    return count;
+  }
+
+  // Same as poll(), but wait up to `timeout` milliseconds (-1 for no limit)
+  // for events if there are none. Returns 0 on timeout, or once the input
+  // thread is done.
+  size_t wait(std::span<event> out, int timeout = -1) {
+    const auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::milliseconds{timeout};
+    for (;;) {
+      if (const size_t count = poll(out); count != 0) {
+        return count;
+      }
+      // The input thread only signals the eventfd when it sees this flag,
+      // set it before checking the ring one last time
+      idle_.store(true);
+      if (const size_t count = poll(out); count != 0 || !running()) {
+        idle_.store(false);
+        return count;
+      }
+      const int left =
+          timeout < 0 ? -1
+                      : std::max(0, static_cast<int>(
+                                        std::chrono::ceil<
+                                            std::chrono::milliseconds>(
+                                            deadline -
+                                            std::chrono::steady_clock::now())
+                                            .count()));
+      pollfd fd{.fd = wakeup_fd_, .events = POLLIN, .revents = 0};
+      const int ready = ::poll(&fd, 1, left);
+      idle_.store(false);
+      u64 drain = 0;
+      [[maybe_unused]] auto _ = read(wakeup_fd_, &drain, sizeof(drain));
+      if (ready == 0) {
+        return poll(out);
+      }
+    }
+  }
+
+  // Becomes readable when the consumer waits in wait() and events arrive,
+  // for consumers waiting on several file descriptors themselves. Set
+  // expect_wakeup() before waiting on it, and call poll() once it's
+  // readable.
+  [[nodiscard]] int wakeup_fd() const noexcept { return wakeup_fd_; }
+
+  // Ask for wakeup_fd() to be signaled when events arrive. Check poll()
+  // once more after calling it, events may have come in the meantime.
+  void expect_wakeup() noexcept { idle_.store(true); }
+
+  // Text of the oldest paste event given to the consumer whose text hasn't
+  // been taken yet
+  [[nodiscard]] std::string take_pasted_text() {
+    std::lock_guard lock{pastes_mutex_};
+    if (pastes_.empty()) {
+      return {};
+    }
+    std::string text = std::move(pastes_.front());
+    pastes_.pop_front();
+    return text;
+  }
+
+  // Last cursor position reported by the terminal
+  [[nodiscard]] term_position cursor_position() const noexcept {
+    const u32 position = cursor_position_.load(std::memory_order_relaxed);
+    return term_position{.col = static_cast<u16>(position >> 16),
+                         .row = static_cast<u16>(position & 0xFFFF)};
+  }
+
+  // False once the input is over or the thread failed, poll() and wait()
+  // rethrow the error once the ring is empty
+  [[nodiscard]] bool running() const noexcept {
+    return running_.load(std::memory_order_acquire);
+  }
+
+private:
+  context_type &context_;
+  int escape_timeout_;
+  int wakeup_fd_;
+  int stop_fd_;
+  spsc_ring<event, Capacity> ring_;
+  std::atomic<bool> idle_{false};      // The consumer waits on wakeup_fd_
+  std::atomic<u32> drained_{0};        // Bumped when the ring has room
+  std::atomic<bool> stopping_{false};  // Set by the destructor
+  std::atomic<bool> running_{true};
+  std::atomic<u32> cursor_position_{0xFFFF'FFFF}; // col << 16 | row
+  std::exception_ptr error_;
+  std::mutex pastes_mutex_;
+  std::deque<std::string> pastes_;
+  std::thread thread_;
+
+  void close_fds() noexcept {
+    for (int fd : {wakeup_fd_, stop_fd_}) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+  }
+
+  void push(event ev) {
+    while (!ring_.try_push(ev)) {
+      // Full, wait for the consumer to make room
+      const u32 seen = drained_.load(std::memory_order_acquire);
+      if (stopping_.load()) {
+        return;
+      }
+      if (!ring_.try_push(ev)) {
+        drained_.wait(seen);
+        continue;
+      }
+      break;
+    }
+    if (idle_.exchange(false)) {
+      const u64 one = 1;
+      [[maybe_unused]] auto _ = write(wakeup_fd_, &one, sizeof(one));
+    }
+  }
+
+  void run() noexcept {
+    try {
+      loop();
+    } catch (...) {
+      error_ = std::current_exception();
+    }
+    running_.store(false, std::memory_order_release);
+    if (idle_.exchange(false)) {
+      const u64 one = 1;
+      [[maybe_unused]] auto _ = write(wakeup_fd_, &one, sizeof(one));
+    }
+  }
+
+  void loop() {
+    Parser parser;
+    detail::escape_timer escape;
+    char buffer[4096];
+    std::string paste; // Parts of a paste spanning reads
+    const auto on_event = [&](event ev, std::string_view sequence) {
+      if (ev.is_paste_event()) {
+        paste.append(sequence);
+        if (ev.is_partial_paste_event()) {
+          return; // The consumer gets the whole paste at once
+        }
+        std::lock_guard lock{pastes_mutex_};
+        pastes_.push_back(std::exchange(paste, {}));
+      } else if (ev.is_cursor_report_event()) {
+        const term_position position = parser.cursor_position();
+        cursor_position_.store((u32{position.col} << 16) | position.row,
+                               std::memory_order_relaxed);
+      }
+      push(ev);
+    };
+
+    for (;;) {
+      pollfd fds[3];
+      fds[0] = {.fd = context_.input_fd(), .events = POLLIN, .revents = 0};
+      fds[1] = {.fd = stop_fd_, .events = POLLIN, .revents = 0};
+      // Ignored by poll() if -1
+      fds[2] = {.fd = context_.resize_fd(), .events = POLLIN, .revents = 0};
+      if (::poll(fds, 3, escape.poll_timeout(-1)) == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw errno_exception{};
+      }
+      if (fds[1].revents != 0 || stopping_.load()) {
+        return;
+      }
+      if (fds[2].revents != 0) {
+        context_.acknowledge_resize();
+        push(event::resize{});
+      }
+      if (fds[0].revents != 0) {
+        const auto size = read(context_.input_fd(), buffer, sizeof(buffer));
+        if (size == 0) {
+          return; // End of input
+        }
+        if (size == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            continue;
+          }
+          throw errno_exception{};
+        }
+        context_.process_input(
+            parser, std::span<const char>{buffer, static_cast<size_t>(size)},
+            on_event);
+        escape.update(parser, escape_timeout_);
+      } else if (escape.expired()) {
+        escape.disarm();
+        event ev;
+        if (parser.flush({&ev, 1}) != 0) {
+          on_event(ev, parser.last_sequence());
+        }
+      }
+    }
+  }
+};
+
+} // namespace dpsg
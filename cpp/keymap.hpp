@@ -0,0 +1,264 @@
+#pragma once
+
+#include "linux_term.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <concepts>
+#include <functional>
+#include <stdexcept>
+#include <utility>
+
+namespace dpsg {
+
+template <class Handler> struct key_binding {
+  event::key key;
+  Handler handler;
+};
+
+// Table from keys to handlers (function pointers, command ids, names...),
+// typically built at compile time from the term_events DSL:
+//
+//   constexpr auto editor_keys = make_keymap<void (*)(editor &)>({
+//       {ctrl + 's', &save},
+//       {ctrl + 'q', &quit},
+//       {arrow_up, &move_up},
+//   });
+//   editor_keys.dispatch(ev, my_editor);
+//
+// The keys are laid out with a perfect hash: they are spread into buckets,
+// and every bucket gets a displacement chosen so that its keys land in slots
+// no other key uses. Looking up an event hashes it twice and compares it
+// with the single key found in its slot, however many bindings there are.
+//
+// An event matches a binding when it compares equal to its key: modifiers
+// must be the same, and releases reported by the kitty keyboard protocol
+// don't match. Binding the same key twice is an error.
+template <std::semiregular Handler, size_t N> class keymap {
+  constexpr static inline size_t bucket_count = std::bit_ceil(N);
+  constexpr static inline size_t slot_count = 2 * bucket_count;
+  constexpr static inline u32 max_displacement = 1 << 16;
+
+public:
+  constexpr explicit keymap(const key_binding<Handler> (&bindings)[N]) {
+    std::array<u64, N> keys{};
+    std::array<size_t, N> order{};
+    for (size_t i = 0; i < N; ++i) {
+      keys[i] = pack(bindings[i].key);
+      order[i] = i;
+    }
+
+    // Group the bindings by bucket, and place the largest buckets first
+    // while the table is mostly empty
+    std::array<size_t, bucket_count> sizes{};
+    for (u64 key : keys) {
+      ++sizes[bucket_of(key)];
+    }
+    std::sort(order.begin(), order.end(), [&](size_t left, size_t right) {
+      const size_t l = bucket_of(keys[left]);
+      const size_t r = bucket_of(keys[right]);
+      return sizes[l] != sizes[r] ? sizes[l] > sizes[r] : l < r;
+    });
+
+    for (size_t first = 0; first < N;) {
+      const size_t bucket = bucket_of(keys[order[first]]);
+      const size_t last = first + sizes[bucket];
+      for (size_t i = first; i < last; ++i) {
+        for (size_t j = i + 1; j < last; ++j) {
+          if (keys[order[i]] == keys[order[j]]) {
+            throw std::invalid_argument("key bound twice in keymap");
+          }
+        }
+      }
+      u32 displacement = 0;
+      while (!fits(keys, order, first, last, displacement)) {
+        if (++displacement == max_displacement) {
+          throw std::logic_error("no perfect hash found for keymap");
+        }
+      }
+      displacements_[bucket] = displacement;
+      for (size_t i = first; i < last; ++i) {
+        auto &s = slots_[slot_of(keys[order[i]], displacement)];
+        s.key = keys[order[i]];
+        s.handler = bindings[order[i]].handler;
+      }
+      first = last;
+    }
+  }
+
+  // Handler bound to `key`, null if there's none
+  [[nodiscard]] constexpr const Handler *find(event::key key) const noexcept {
+    const u64 packed = pack(key);
+    const auto &s =
+        slots_[slot_of(packed, displacements_[bucket_of(packed)])];
+    return s.key == packed ? &s.handler : nullptr;
+  }
+
+  [[nodiscard]] const Handler *find(event ev) const noexcept {
+    return ev.is_key_event() ? find(ev.get_key()) : nullptr;
+  }
+
+  // Call the handler bound to `ev` with `args`. Returns false if there is
+  // none.
+  template <class... Args>
+    requires std::invocable<const Handler &, Args...>
+  bool dispatch(event ev, Args &&...args) const {
+    if (const Handler *handler = find(ev)) {
+      std::invoke(*handler, std::forward<Args>(args)...);
+      return true;
+    }
+    return false;
+  }
+
+  [[nodiscard]] constexpr static size_t size() noexcept { return N; }
+
+private:
+  struct slot {
+    u64 key = 0; // Never 0 for an actual key, they all have Key_Marker
+    Handler handler{};
+  };
+
+  std::array<u32, bucket_count> displacements_{};
+  std::array<slot, slot_count> slots_{};
+
+  // Everything but key::repeats, so that merged key events find their handler
+  constexpr static u64 pack(event::key key) noexcept {
+    return u64{(u8)key.code} | (u64{(u8)key.cont[0]} << 8) |
+           (u64{(u8)key.cont[1]} << 16) | (u64{(u8)key.cont[2]} << 24) |
+           (u64{(u8)key.kind} << 48) | (u64{(u8)key.mods} << 56);
+  }
+
+  // MurmurHash3 finalizer, every bit of the key affects every bit of the
+  // result
+  constexpr static u64 mix(u64 value) noexcept {
+    value ^= value >> 33;
+    value *= 0xFF51AFD7ED558CCDULL;
+    value ^= value >> 33;
+    value *= 0xC4CEB9FE1A85EC53ULL;
+    value ^= value >> 33;
+    return value;
+  }
+
+  constexpr static size_t bucket_of(u64 key) noexcept {
+    return static_cast<size_t>(mix(key) & (bucket_count - 1));
+  }
+
+  constexpr static size_t slot_of(u64 key, u32 displacement) noexcept {
+    return static_cast<size_t>(
+        mix(key + (u64{displacement} + 1) * 0x9E3779B97F4A7C15ULL) &
+        (slot_count - 1));
+  }
+
+  // Whether the keys of order[first, last) all land in distinct free slots
+  // with `displacement`
+  constexpr bool fits(const std::array<u64, N> &keys,
+                      const std::array<size_t, N> &order, size_t first,
+                      size_t last, u32 displacement) const noexcept {
+    for (size_t i = first; i < last; ++i) {
+      const size_t s = slot_of(keys[order[i]], displacement);
+      if (slots_[s].key != 0) {
+        return false;
+      }
+      for (size_t j = first; j < i; ++j) {
+        if (slot_of(keys[order[j]], displacement) == s) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+};
+
+template <std::semiregular Handler, size_t N>
+constexpr keymap<Handler, N>
+make_keymap(const key_binding<Handler> (&bindings)[N]) {
+  return keymap<Handler, N>{bindings};
+}
+
+namespace detail {
+// Bindings of the checks below: letters, control characters, function keys,
+// a character of several bytes and an extended key
+constexpr inline key_binding<int> checked_bindings[] = {
+    {event::key{'a'}, 0},
+    {event::key{'b'}, 1},
+    {event::key{'A'}, 2},
+    {term_events::ctrl + 'a', 3},
+    {term_events::ctrl + 's', 4},
+    {term_events::alt + 'x', 5},
+    {term_events::enter, 6},
+    {term_events::esc, 7},
+    {term_events::backspace, 8},
+    {term_events::arrow_up, 9},
+    {term_events::ctrl + term_events::arrow_up, 10},
+    {term_events::arrow_down, 11},
+    {term_events::f1, 12},
+    {term_events::f5, 13},
+    {term_events::shift + term_events::f12, 14},
+    {term_events::home, 15},
+    {term_events::del, 16},
+    {term_events::page_down, 17},
+    {[] {
+       event::key e_acute{'\xc3', event::key::modifiers::Unicode};
+       e_acute.cont[0] = '\xa9';
+       return e_acute;
+     }(),
+     18},
+    {term_events::left_ctrl, 19},
+};
+
+// Bound to nothing above
+constexpr inline event::key unbound_keys[] = {
+    event::key{'z'},          term_events::ctrl + 'z',
+    term_events::arrow_right, term_events::f12,
+    term_events::end,         term_events::extended_key(57400),
+};
+
+constexpr bool same_key(event::key left, event::key right) noexcept {
+  return left.code == right.code && left.cont[0] == right.cont[0] &&
+         left.cont[1] == right.cont[1] && left.cont[2] == right.cont[2] &&
+         left.kind == right.kind && left.mods == right.mods;
+}
+
+// Whether `map` finds the handler bound to `key` in checked_bindings, or
+// nothing if it isn't bound
+template <class Map>
+constexpr bool finds_binding(const Map &map, event::key key) noexcept {
+  const int *found = map.find(key);
+  for (const auto &binding : checked_bindings) {
+    if (same_key(binding.key, key)) {
+      return found != nullptr && *found == binding.handler;
+    }
+  }
+  return found == nullptr;
+}
+
+constexpr bool keymap_finds_bindings() noexcept {
+  constexpr auto map = make_keymap(checked_bindings);
+  for (const auto &binding : checked_bindings) {
+    auto repeated = binding.key;
+    repeated.repeats = 3;
+    auto released = binding.key;
+    released.kind = event::key::kinds::Release;
+    // Modifier variants miss unless they're bound too
+    if (!finds_binding(map, binding.key) || !finds_binding(map, repeated) ||
+        !finds_binding(map, released) ||
+        !finds_binding(map, binding.key | event::key::modifiers::Shift) ||
+        !finds_binding(map, binding.key | event::key::modifiers::Alt) ||
+        !finds_binding(map, binding.key | event::key::modifiers::Ctrl)) {
+      return false;
+    }
+  }
+  for (auto key : unbound_keys) {
+    if (map.find(key) != nullptr) {
+      return false;
+    }
+  }
+  return true;
+}
+} // namespace detail
+
+static_assert(detail::keymap_finds_bindings());
+
+} // namespace dpsg
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <ostream>
+
+namespace dpsg {
+
+// Histogram of durations in the spirit of HdrHistogram. Values below
+// 2^Precision nanoseconds are counted exactly, larger ones in buckets whose
+// width doubles with every power of two, each power being split in
+// 2^Precision buckets. Values reported back are therefore off by less than
+// 1/2^Precision (3% by default), whatever their magnitude.
+//
+// Recording is a few arithmetic operations on a fixed array, it never
+// allocates and is cheap enough for the input path.
+template <unsigned Precision = 5> class latency_histogram {
+  static_assert(Precision > 0 && Precision < 16);
+  static constexpr u64 sub_buckets = u64{1} << Precision;
+
+public:
+  using duration = std::chrono::nanoseconds;
+
+  void record(duration value) noexcept {
+    const u64 ns = value.count() < 0 ? 0 : static_cast<u64>(value.count());
+    ++counts_[index_of(ns)];
+    ++total_;
+    min_ = std::min(min_, ns);
+    max_ = std::max(max_, ns);
+  }
+
+  [[nodiscard]] u64 count() const noexcept { return total_; }
+
+  [[nodiscard]] duration min() const noexcept {
+    return duration{total_ == 0 ? 0 : min_};
+  }
+
+  [[nodiscard]] duration max() const noexcept { return duration{max_}; }
+
+  // Smallest value that `percent` % of the recorded values don't exceed, 0
+  // if nothing was recorded.
+  [[nodiscard]] duration percentile(double percent) const noexcept {
+    if (total_ == 0) {
+      return duration{0};
+    }
+    const auto rank = static_cast<u64>(
+        std::ceil(std::clamp(percent, 0.0, 100.0) / 100.0 * total_));
+    u64 seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= std::max(rank, u64{1})) {
+        return duration{std::min(highest_in(i), max_)};
+      }
+    }
+    return duration{max_};
+  }
+
+  void reset() noexcept {
+    counts_.fill(0);
+    total_ = 0;
+    min_ = std::numeric_limits<u64>::max();
+    max_ = 0;
+  }
+
+  friend std::ostream &operator<<(std::ostream &os,
+                                  const latency_histogram &h) {
+    const auto us = [](duration d) { return d.count() / 1000.0; };
+    return os << "count " << h.count() << ", min " << us(h.min())
+              << "us, p50 " << us(h.percentile(50)) << "us, p90 "
+              << us(h.percentile(90)) << "us, p99 " << us(h.percentile(99))
+              << "us, p99.9 " << us(h.percentile(99.9)) << "us, max "
+              << us(h.max()) << "us";
+  }
+
+private:
+  // Values in [2^m, 2^(m+1)) for m >= Precision are shifted right until
+  // they fit in Precision + 1 bits, the shift selecting the range of buckets
+  static constexpr size_t index_of(u64 value) noexcept {
+    if (value < sub_buckets) {
+      return static_cast<size_t>(value);
+    }
+    const auto shift = static_cast<unsigned>(std::bit_width(value)) - 1 -
+                       Precision;
+    return static_cast<size_t>(shift * sub_buckets + (value >> shift));
+  }
+
+  static constexpr u64 highest_in(size_t index) noexcept {
+    if (index < sub_buckets) {
+      return index;
+    }
+    const u64 shift = index / sub_buckets - 1;
+    const u64 sub = index - shift * sub_buckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::array<u64, (65 - Precision) * sub_buckets> counts_{};
+  u64 total_ = 0;
+  u64 min_ = std::numeric_limits<u64>::max();
+  u64 max_ = 0;
+};
+
+} // namespace dpsg
@@ -1,18 +1,43 @@
 #pragma once
 
 #include "generator.hpp"
+#include "latency_histogram.hpp"
+#include "recording.hpp"
 #include "types.hpp"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <bit>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstring>
+#include <deque>
 #include <format>
+#include <future>
+#include <optional>
+#include <span>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+extern "C" {
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+}
 
 namespace dpsg {
 
@@ -130,22 +155,16 @@ template <size_t BufSize>
 invalid_function_key(char (&)[BufSize], size_t last, char c)
     -> invalid_function_key<BufSize>;
 
-extern "C" {
-#include <poll.h>
-#include <sys/ioctl.h>
-#include <termios.h>
-#include <unistd.h>
-}
-
-inline void raw_mode_enable(struct termios *ctx, int new_mode) {
-  tcgetattr(STDIN_FILENO, ctx);
+inline void raw_mode_enable(struct termios *ctx, int new_mode,
+                            int fd = STDIN_FILENO) {
+  tcgetattr(fd, ctx);
   struct termios raw = *ctx;
   raw.c_lflag &= ~(new_mode);
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+  tcsetattr(fd, TCSAFLUSH, &raw);
 }
 
-inline void raw_mode_disable(struct termios *ctx) {
-  tcsetattr(STDIN_FILENO, TCSAFLUSH, ctx);
+inline void raw_mode_disable(struct termios *ctx, int fd = STDIN_FILENO) {
+  tcsetattr(fd, TCSAFLUSH, ctx);
 }
 
 // XTERM Mouse codes
@@ -155,19 +174,61 @@ inline void raw_mode_disable(struct termios *ctx) {
 // SET_SGR_EXT_MODE_MOUSE // Same as default mode but positions are encoded in
 // ASCII, allowing for arbitrary positions
 
-inline void enable_mouse_tracking() {
-  write(STDOUT_FILENO, "\033[?1003h", 8); // enable SET_ANY_EVENT_MOUSE
-  write(STDOUT_FILENO, "\033[?1006h", 8); // enable SET_SGR_EXT_MODE_MOUSE
-  fsync(STDOUT_FILENO);
+inline void enable_mouse_tracking(int fd = STDOUT_FILENO) {
+  write(fd, "\033[?1003h", 8); // enable SET_ANY_EVENT_MOUSE
+  write(fd, "\033[?1006h", 8); // enable SET_SGR_EXT_MODE_MOUSE
+  fsync(fd);
 }
 
-inline void disable_mouse_tracking() {
-  write(STDOUT_FILENO, "\033[?1006l", 8); // disable SET_SGR_EXT_MODE_MOUSE
-  write(STDOUT_FILENO, "\033[?1003l", 8); // disable SET_ANY_EVENT_MOUSE
-  fsync(STDOUT_FILENO);
+inline void disable_mouse_tracking(int fd = STDOUT_FILENO) {
+  write(fd, "\033[?1006l", 8); // disable SET_SGR_EXT_MODE_MOUSE
+  write(fd, "\033[?1003l", 8); // disable SET_ANY_EVENT_MOUSE
+  fsync(fd);
 }
 
-inline void query_cursor_position() { write(STDOUT_FILENO, "\033[6n", 4); }
+// Bracketed paste: pasted text is surrounded by ^[[200~ and ^[[201~ instead
+// of being sent as if it were typed
+inline void enable_bracketed_paste(int fd = STDOUT_FILENO) {
+  write(fd, "\033[?2004h", 8);
+  fsync(fd);
+}
+
+inline void disable_bracketed_paste(int fd = STDOUT_FILENO) {
+  write(fd, "\033[?2004l", 8);
+  fsync(fd);
+}
+
+// Progressive enhancements of the kitty keyboard protocol, to be combined
+// and given to enable_kitty_keyboard()
+namespace kitty_keyboard {
+// Esc, and keys with modifiers that are ambiguous otherwise, as ^[[...u
+constexpr static inline u8 disambiguate = 1;
+// Repeats and releases, see event::key::kind
+constexpr static inline u8 report_event_types = 2;
+constexpr static inline u8 report_alternate_keys = 4;
+// Every key as ^[[...u, including plain text, Enter, Tab and Backspace
+constexpr static inline u8 report_all_keys = 8;
+constexpr static inline u8 report_text = 16;
+} // namespace kitty_keyboard
+
+// Push `flags` on the stack of keyboard modes of the terminal, until
+// disable_kitty_keyboard() pops them. Terminals that don't support the
+// protocol ignore both.
+inline void enable_kitty_keyboard(u8 flags, int fd = STDOUT_FILENO) {
+  const char sequence[] = {'\033', '[', '>', (char)('0' + flags / 10 % 10),
+                           (char)('0' + flags % 10), 'u'};
+  write(fd, sequence, sizeof(sequence));
+  fsync(fd);
+}
+
+inline void disable_kitty_keyboard(int fd = STDOUT_FILENO) {
+  write(fd, "\033[<u", 4);
+  fsync(fd);
+}
+
+inline void query_cursor_position(int fd = STDOUT_FILENO) {
+  write(fd, "\033[6n", 4);
+}
 
 struct term_position {
   union {
@@ -209,6 +270,18 @@ struct event {
       Key_Marker = 1 << 7,
     };
 
+    // Reported by the kitty keyboard protocol when it's asked to report event
+    // types, keys are otherwise always pressed
+    enum class kinds : u8 {
+      Press = 0,
+      Repeat = 1,
+      Release = 2,
+    };
+
+    // Code of the keys reported by the kitty keyboard protocol that have no
+    // legacy encoding (modifiers, keypad, media keys...), see extended_code()
+    constexpr static inline char extended_marker = (char)0xFE;
+
     explicit constexpr key() = default;
     explicit constexpr key(char value,
                            key::modifiers mods = key::modifiers::None) noexcept
@@ -218,7 +291,8 @@ struct event {
       struct {
         char code;
         char cont[3]{};
-        u8 _padding[3]{};
+        u16 repeats{}; // Identical key events merged into this one
+        kinds kind{};
         modifiers mods;
       };
       char data[8];
@@ -274,6 +348,23 @@ struct event {
     [[nodiscard]] constexpr bool shift_pressed() const {
       return (mods & modifiers::Shift) == modifiers::Shift;
     }
+
+    [[nodiscard]] constexpr bool is_release() const {
+      return kind == kinds::Release;
+    }
+
+    [[nodiscard]] constexpr bool is_repeat() const {
+      return kind == kinds::Repeat;
+    }
+
+    [[nodiscard]] constexpr bool is_extended() const {
+      return code == extended_marker && is_function_key();
+    }
+
+    // Kitty code of an extended key, in the unicode private use area
+    [[nodiscard]] constexpr u16 extended_code() const {
+      return static_cast<u16>((u8)cont[0] | ((u8)cont[1] << 8));
+    }
   };
 
   struct mouse {
@@ -309,9 +400,13 @@ struct event {
 
     u16 x;
     u16 y;
-    u8 _padding[3];
+    u16 coalesced{}; // Motion events dropped in favor of this one
+    bool motion{};   // Reported because the mouse moved, with or without a
+                     // button held
     modifiers mods;
 
+    [[nodiscard]] constexpr bool is_motion() const noexcept { return motion; }
+
     [[nodiscard]] constexpr buttons button() const noexcept {
       return (buttons)(mods ^ (modifiers::Release | modifiers::Shift |
                                modifiers::Alt | modifiers::Ctrl));
@@ -358,9 +453,68 @@ struct event {
     }
   };
 
+  // Special events are keys with code 0xFF and the Special modifier, the kind
+  // of event is stored in the first continuation byte
+  enum class special_kinds : u8 {
+    None = 0,
+    Error = 1,
+    Paste = 2,
+    Resize = 3,
+    CursorPosition = 4,
+  };
+
+  // Malformed input reported in band. A malformed control sequence is
+  // skipped up to its final character, and a character that can't be part of
+  // a sequence (^[, another control character, UTF-8) starts what follows.
+  struct error {
+    enum class reasons : u8 {
+      invalid_sequence_start = 1,
+      unfinished_numeric_sequence,
+      invalid_function_key,
+      invalid_parameters,
+    };
+
+    reasons reason;
+    char character; // Character that broke the sequence
+  };
+
+  // Text pasted while bracketed paste is enabled. The event itself carries no
+  // data, the pasted text is reported along with it by the parser and the
+  // streams. A paste that doesn't fit in one read is reported in several
+  // parts, all of them but the last with `more` set.
+  struct paste {
+    bool more = false;
+  };
+
+  // The terminal was resized. The new size is available from the context.
+  struct resize {};
+
+  // The terminal answered a cursor position query. The position is available
+  // from the parser or the context.
+  struct cursor_report {};
+
   explicit constexpr event() noexcept : _cheat_{0} {}
   constexpr event(key key) noexcept : key_{key} {}
   constexpr event(mouse mouse) noexcept : mouse_{mouse} {}
+  constexpr event(error error) noexcept
+      : key_{(char)0xFF, key::modifiers::Special} {
+    key_.cont[0] = (char)special_kinds::Error;
+    key_.cont[1] = (char)error.reason;
+    key_.cont[2] = error.character;
+  }
+  constexpr event(paste paste) noexcept
+      : key_{(char)0xFF, key::modifiers::Special} {
+    key_.cont[0] = (char)special_kinds::Paste;
+    key_.cont[1] = (char)paste.more;
+  }
+  constexpr event(resize) noexcept
+      : key_{(char)0xFF, key::modifiers::Special} {
+    key_.cont[0] = (char)special_kinds::Resize;
+  }
+  constexpr event(cursor_report) noexcept
+      : key_{(char)0xFF, key::modifiers::Special} {
+    key_.cont[0] = (char)special_kinds::CursorPosition;
+  }
   union {
     key key_;
     mouse mouse_;
@@ -377,6 +531,35 @@ struct event {
 
   [[nodiscard]] bool is_mouse_event() const noexcept { return !is_key_event(); }
 
+  [[nodiscard]] special_kinds special_kind() const noexcept {
+    if (!is_key_event() || key_.code != (char)0xFF ||
+        !key_.is_function_key()) {
+      return special_kinds::None;
+    }
+    return (special_kinds)key_.cont[0];
+  }
+
+  [[nodiscard]] bool is_error_event() const noexcept {
+    return special_kind() == special_kinds::Error;
+  }
+
+  [[nodiscard]] bool is_paste_event() const noexcept {
+    return special_kind() == special_kinds::Paste;
+  }
+
+  // A paste event whose text goes on with the next paste event
+  [[nodiscard]] bool is_partial_paste_event() const noexcept {
+    return is_paste_event() && key_.cont[1] != 0;
+  }
+
+  [[nodiscard]] bool is_resize_event() const noexcept {
+    return special_kind() == special_kinds::Resize;
+  }
+
+  [[nodiscard]] bool is_cursor_report_event() const noexcept {
+    return special_kind() == special_kinds::CursorPosition;
+  }
+
   [[nodiscard]] bool alt_pressed() const noexcept {
     return ((u8)mouse::modifiers::Alt & mods_) != 0;
   }
@@ -389,6 +572,11 @@ struct event {
     return ((u8)mouse::modifiers::Shift & mods_) != 0;
   }
 
+  // Bytes of key::repeats and mouse::coalesced in _cheat_
+  constexpr static inline u64 merged_count_mask =
+      std::endian::native == std::endian::little ? 0x0000'FFFF'0000'0000
+                                                 : 0x0000'0000'FFFF'0000;
+
   friend constexpr bool operator==(event left, event right) noexcept {
     if (std::is_constant_evaluated()) {
       if (left.is_key_event()) {
@@ -413,6 +601,13 @@ struct event {
     return key_;
   }
 
+  [[nodiscard]] constexpr error get_error() const noexcept {
+    if (!std::is_constant_evaluated()) {
+      assert(is_error_event());
+    }
+    return error{(error::reasons)key_.cont[1], key_.cont[2]};
+  }
+
   [[nodiscard]] constexpr mouse get_mouse() const noexcept {
     if (!std::is_constant_evaluated()) {
       assert(is_mouse_event());
@@ -509,6 +704,24 @@ constexpr static inline event::key page_up{5, event::key::modifiers::Special};
 constexpr static inline event::key page_down{6, event::key::modifiers::Special};
 constexpr static inline event::key special_event{(char)0xFF, event::key::modifiers::Special};
 
+// Keys only reported by the kitty keyboard protocol, `code` being their
+// code in the unicode private use area
+constexpr event::key extended_key(u16 code) noexcept {
+  event::key key{event::key::extended_marker, event::key::modifiers::Special};
+  key.cont[0] = (char)(code & 0xFF);
+  key.cont[1] = (char)(code >> 8);
+  return key;
+}
+constexpr static inline event::key caps_lock = extended_key(57358);
+constexpr static inline event::key left_shift = extended_key(57441);
+constexpr static inline event::key left_ctrl = extended_key(57442);
+constexpr static inline event::key left_alt = extended_key(57443);
+constexpr static inline event::key left_super = extended_key(57444);
+constexpr static inline event::key right_shift = extended_key(57447);
+constexpr static inline event::key right_ctrl = extended_key(57448);
+constexpr static inline event::key right_alt = extended_key(57449);
+constexpr static inline event::key right_super = extended_key(57450);
+
 template <size_t N> struct fixed_string {
   constexpr fixed_string(const char (&b)[N]) noexcept {
     for (size_t i = 0; i < N; ++i) {
@@ -527,166 +740,2106 @@ template <fixed_string F> constexpr event::key operator""_key() {
 } // namespace term_events
 
 namespace detail {
+// Merge `ev` into `previous` if they are the same key event, regardless of
+// how many events were merged into either of them so far. Special events
+// (errors, pastes) are never merged.
+inline bool merge_key_repeat(event &previous, event ev) noexcept {
+  if (!ev.is_key_event() || ev.special_kind() != event::special_kinds::None ||
+      ((previous._cheat_ ^ ev._cheat_) & ~event::merged_count_mask) != 0) {
+    return false;
+  }
+  const u32 total = u32{previous.key_.repeats} + 1 + ev.key_.repeats;
+  previous.key_.repeats = static_cast<u16>(std::min<u32>(total, 0xFFFF));
+  return true;
+}
+} // namespace detail
 
-constexpr static inline std::initializer_list<int> HANDLED_SIGNALS = {
-    SIGINT, SIGSEGV, SIGTERM, SIGILL, SIGFPE, SIGABRT};
-constexpr static inline auto MAX_SIGNAL =
-    HANDLED_SIGNALS.size() + 2; // SIGCONT & SIGTSTP
-constexpr static inline auto INDEX_HANDLER_SIGTSTP = MAX_SIGNAL - 1;
-constexpr static inline auto INDEX_HANDLER_SIGCONT = INDEX_HANDLER_SIGTSTP - 1;
-constexpr size_t index_of(int signal) {
-  size_t i = 0;
-  for (auto sig : HANDLED_SIGNALS) {
-    if (sig == signal) {
-      return i;
+// Collapse runs of identical key events into the first one of each run,
+// which keeps the number of events it replaces in key::repeats. Special
+// events (errors, pastes) are never merged. Returns the number of events
+// left at the start of `events`.
+inline size_t collapse_key_repeats(std::span<event> events) noexcept {
+  size_t kept = 0;
+  for (event ev : events) {
+    if (kept == 0 || !detail::merge_key_repeat(events[kept - 1], ev)) {
+      events[kept++] = ev;
     }
-    ++i;
   }
-  return -1; // Just don't let it happen
+  return kept;
 }
-extern struct sigaction new_sa[MAX_SIGNAL], old_sa[MAX_SIGNAL];
-extern struct termios orig_termios;
-extern bool require_mouse;
-} // namespace detail
 
-template <int Mode> struct raw_mode_context_basic {
+// Collapse runs of consecutive mouse motion events sharing the same buttons
+// and modifiers into the last one of each run, which keeps the number of
+// events it replaces in mouse::coalesced. Any other event breaks a run, so
+// presses, releases and keys keep their exact order. Returns the number of
+// events left at the start of `events`.
+inline size_t coalesce_mouse_motion(std::span<event> events) noexcept {
+  size_t kept = 0;
+  for (event ev : events) {
+    if (kept != 0 && ev.is_mouse_event() && ev.mouse_.is_motion()) {
+      event &previous = events[kept - 1];
+      if (previous.is_mouse_event() && previous.mouse_.is_motion() &&
+          previous.mouse_.mods == ev.mouse_.mods) {
+        const u32 total = u32{previous.mouse_.coalesced} + 1 +
+                          ev.mouse_.coalesced;
+        ev.mouse_.coalesced = static_cast<u16>(std::min<u32>(total, 0xFFFF));
+        previous = ev;
+        continue;
+      }
+    }
+    events[kept++] = ev;
+  }
+  return kept;
+}
 
-  raw_mode_context_basic() noexcept {
-    raw_mode_enable(&detail::orig_termios, Mode);
-    register_signal_handlers();
+// Keys currently held down, as told by the key events given to update().
+// Only the kitty keyboard protocol reports releases (see
+// enable_kitty_keyboard()), legacy keys stay held until clear() is called.
+// Keys are tracked regardless of modifiers, so Ctrl+a holds 'a'. ASCII
+// keys, function keys and extended keys are tracked, other unicode keys are
+// ignored.
+class held_keys {
+public:
+  void update(event ev) noexcept {
+    if (!ev.is_key_event() || ev.special_kind() != event::special_kinds::None) {
+      return;
+    }
+    const event::key key = ev.get_key();
+    if (const size_t index = index_of(key); index != untracked) {
+      keys_.set(index, !key.is_release());
+    }
   }
 
-private:
-  static void set_handler(int signal, void (*func)(int), size_t index) {
-    memset(&detail::new_sa[index], 0, sizeof(detail::new_sa[index]));
-    detail::new_sa[index].sa_handler = func;
-    sigaction(signal, &detail::new_sa[index], &detail::old_sa[index]);
+  [[nodiscard]] bool held(event::key key) const noexcept {
+    const size_t index = index_of(key);
+    return index != untracked && keys_.test(index);
   }
 
-  static void restore_old_and_raise(int sig, size_t idx) {
-    sigaction(sig, &detail::old_sa[idx], nullptr);
-    raise(sig);
+  [[nodiscard]] bool any() const noexcept { return keys_.any(); }
+
+  [[nodiscard]] size_t count() const noexcept { return keys_.count(); }
+
+  void clear() noexcept { keys_.reset(); }
+
+private:
+  // ASCII keys, then function keys, then extended keys from the start of
+  // the private use area where kitty puts them
+  constexpr static inline size_t function_keys = 128;
+  constexpr static inline size_t extended_keys = 256;
+  constexpr static inline u16 first_extended_code = 57344;
+  constexpr static inline size_t untracked = static_cast<size_t>(-1);
+
+  std::bitset<extended_keys + 128> keys_;
+
+  static constexpr size_t index_of(event::key key) noexcept {
+    if (key.is_extended()) {
+      const u16 code = key.extended_code();
+      return code >= first_extended_code && code - first_extended_code < 128
+                 ? extended_keys + (code - first_extended_code)
+                 : untracked;
+    }
+    const auto code = static_cast<u8>(key.code);
+    if ((key.mods & event::key::modifiers::Unicode) !=
+            event::key::modifiers::None ||
+        code >= 128) {
+      return untracked;
+    }
+    return key.is_function_key() ? function_keys + code : code;
   }
+};
 
-  void register_signal_handlers() {
-    for (int signal : detail::HANDLED_SIGNALS) {
-      set_handler(signal, &raw_mode_context_basic::handle_fatal_signal,
-                  detail::index_of(signal));
+namespace detail {
+// Characters that can be turned into a key event on their own: everything
+// but control characters (including ^[) and UTF-8 sequences. Since char is
+// signed, the latter compare lower than ' ' too.
+constexpr bool is_plain_character(char c) noexcept {
+  return static_cast<signed char>(c) >= ' ';
+}
+
+// Length of the run of plain characters at the beginning of [begin, end)
+inline size_t plain_character_run(const char *begin, const char *end) noexcept {
+  const char *current = begin;
+#if defined(__AVX2__)
+  const __m256i bound = _mm256_set1_epi8(' ');
+  for (; end - current >= 32; current += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(current));
+    const auto mask = static_cast<u32>(
+        _mm256_movemask_epi8(_mm256_cmpgt_epi8(bound, chunk)));
+    if (mask != 0) {
+      return (current - begin) + std::countr_zero(mask);
     }
-    set_handler(SIGTSTP, &raw_mode_context_basic::handle_sigtstp,
-                detail::INDEX_HANDLER_SIGTSTP);
   }
+#endif
+#if defined(__SSE2__)
+  const __m128i bound_sse = _mm_set1_epi8(' ');
+  for (; end - current >= 16; current += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(current));
+    const auto mask =
+        static_cast<u32>(_mm_movemask_epi8(_mm_cmplt_epi8(chunk, bound_sse)));
+    if (mask != 0) {
+      return (current - begin) + std::countr_zero(mask);
+    }
+  }
+#endif
+  while (current != end && is_plain_character(*current)) {
+    ++current;
+  }
+  return current - begin;
+}
 
-  // Called on interuption from the outside (Ctrl-Z)
-  static void handle_sigtstp(int sig) {
-    set_handler(SIGCONT, &raw_mode_context_basic::handle_sigcont,
-                detail::INDEX_HANDLER_SIGCONT);
-    raw_mode_disable(&detail::orig_termios);
-    if (detail::require_mouse) {
-      ::dpsg::disable_mouse_tracking();
+// Same as event{event::key{c}}. Building the key member by member ends up as
+// a series of byte stores that stall the load of the whole event, which is
+// noticeable when converting long runs of text.
+inline event plain_key_event(char c) noexcept {
+  constexpr u64 marker = static_cast<u8>(event::key::modifiers::Key_Marker);
+  event ev;
+  if constexpr (std::endian::native == std::endian::little) {
+    ev._cheat_ = static_cast<u8>(c) | (marker << 56);
+  } else {
+    ev._cheat_ = (static_cast<u64>(static_cast<u8>(c)) << 56) | marker;
+  }
+  return ev;
+}
+
+// Parts shared by the input parser backends: the characters of the current
+// sequence, unicode characters and the conversion of the parsed values into
+// events. Parser must provide parse().
+template <class Parser> class input_parser_base {
+public:
+  // Longest sequence kept to report the characters of an event or an error.
+  // Longer sequences are still parsed, but their report is truncated.
+  constexpr static inline size_t max_sequence_size = 32;
+
+  struct parse_result {
+    size_t consumed; // Number of characters consumed from the input
+    size_t events;   // Number of events written to the output
+  };
+
+  // Parse `input` and call `on_event` with every complete event and the
+  // characters that produced it.
+  template <class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  void feed(std::span<const char> input, F &&on_event) {
+    event ev;
+    while (!input.empty()) {
+      auto [consumed, events] =
+          static_cast<Parser &>(*this).parse(input, {&ev, 1});
+      input = input.subspan(consumed);
+      if (events != 0) {
+        on_event(ev, last_sequence());
+      }
     }
-    restore_old_and_raise(sig, detail::INDEX_HANDLER_SIGCONT);
   }
 
-  // Called on continue from the outside (fg/bg)
-  static void handle_sigcont(int sig) {
-    set_handler(SIGTSTP, &raw_mode_context_basic::handle_sigtstp,
-                detail::INDEX_HANDLER_SIGTSTP);
-    raw_mode_enable(&detail::orig_termios, Mode);
-    if (detail::require_mouse) {
-      ::dpsg::enable_mouse_tracking();
+  // Characters that produced the last emitted event. They point either into
+  // the input given to parse() or into the parser itself, and are only valid
+  // until the next call to parse() or flush(). When parse() emits several
+  // events at once, only use this when the output holds a single event.
+  [[nodiscard]] std::string_view last_sequence() const noexcept {
+    return last_sequence_;
+  }
+
+  // Last cursor position reported by the terminal
+  [[nodiscard]] term_position cursor_position() const noexcept {
+    return cursor_position_;
+  }
+
+  // Is a bracketed paste waiting for its end marker?
+  [[nodiscard]] bool pasting() const noexcept { return pasting_; }
+
+  // ^[[1;<mod>R is both F3 with modifiers and the cursor being on the first
+  // row. It is read as a cursor position while a query is waiting for its
+  // answer, as F3 otherwise.
+  void expect_cursor_report(bool expect) noexcept {
+    expect_cursor_report_ = expect;
+  }
+
+protected:
+  u8 expected_code_points_ = 0;
+  u8 current_code_point_ = 0;
+  u8 current_param_ = 0; // Index of the number being parsed. Keep it inside
+                         // num_parameters_
+  u8 sub_parameter_ = 0; // Index of the ':' separated part of the current
+                         // parameter, only the first one is kept
+  u8 key_event_type_ = 0; // Kitty event type, after the ':' of the modifiers
+  event result_;
+  u32 num_parameters_[4] = {
+      0}; // Numeric parameters parsed from a control sequence
+  term_position cursor_position_{0xFFFF, 0xFFFF};
+  std::string_view last_sequence_;
+  size_t sequence_size_ = 0; // Characters carried over from previous inputs,
+                             // while pasting the start of the end marker
+  char sequence_[max_sequence_size];
+  bool pasting_ = false; // Between ^[[200~ and ^[[201~
+  bool expect_cursor_report_ = false;
+
+  constexpr static inline u16 paste_start_code = 200;
+  constexpr static inline u16 paste_end_code = 201;
+  constexpr static inline std::string_view paste_end = "\033[201~";
+
+  void start_paste() noexcept { pasting_ = true; }
+
+  // Where a malformed sequence ends, given the character `c` that broke it
+  // or that came after it
+  enum class malformed_end : u8 {
+    here,    // With `c`, the error can be reported
+    before,  // Right before `c`, which is parsed again
+    further, // Further, `c` is a parameter or intermediate character of a
+             // control sequence that goes on up to its final character
+  };
+
+  static malformed_end end_of_malformed(event::error::reasons reason,
+                                        char c) noexcept {
+    const auto u = static_cast<u8>(c);
+    if (u < 0x20 || u >= 0x7F) {
+      return malformed_end::before;
     }
-    restore_old_and_raise(sig, detail::INDEX_HANDLER_SIGTSTP);
+    // Only the function keys of ^[O aren't control sequences
+    if (u < 0x40 && reason != event::error::reasons::invalid_function_key) {
+      return malformed_end::further;
+    }
+    return malformed_end::here;
   }
 
-  static void handle_fatal_signal(int sig) {
-    raw_mode_disable(&detail::orig_termios);
-    if (detail::require_mouse) {
-      ::dpsg::disable_mouse_tracking();
+  // Consume pasted text in [begin, end), up to and including the end marker.
+  // Returns the number of characters consumed, and sets `part` when
+  // last_sequence() is pasted text to report: everything up to the marker,
+  // once it is found and pasting() becomes false, or the text available so
+  // far otherwise. What may be the start of the marker at the end of the
+  // input is held back in sequence_ until the next input tells.
+  size_t continue_paste(const char *begin, const char *end,
+                        bool &part) noexcept {
+    const std::string_view input{begin, end};
+    if (sequence_size_ != 0) {
+      const std::string_view held{sequence_, sequence_size_};
+      const size_t missing = paste_end.size() - held.size();
+      const auto rest = input.substr(0, missing);
+      if (paste_end.substr(held.size(), rest.size()) != rest) {
+        // Pasted text after all, the marker only has one ^[ so none of it
+        // can start another marker
+        last_sequence_ = held;
+        sequence_size_ = 0;
+        part = true;
+        return 0;
+      }
+      if (rest.size() != missing) {
+        carry(rest.data(), rest.data() + rest.size());
+        return rest.size();
+      }
+      last_sequence_ = std::string_view{};
+      sequence_size_ = 0;
+      pasting_ = false;
+      part = true;
+      return rest.size();
     }
 
-    restore_old_and_raise(sig, detail::index_of(sig));
+    if (const auto pos = input.find(paste_end); pos != std::string_view::npos) {
+      last_sequence_ = input.substr(0, pos);
+      pasting_ = false;
+      part = true;
+      return pos + paste_end.size();
+    }
+    size_t held = std::min(input.size(), paste_end.size() - 1);
+    while (held != 0 &&
+           !paste_end.starts_with(input.substr(input.size() - held))) {
+      --held;
+    }
+    carry(end - held, end);
+    last_sequence_ = input.substr(0, input.size() - held);
+    part = !last_sequence_.empty();
+    return input.size();
   }
 
-public:
-  raw_mode_context_basic(const raw_mode_context_basic &) = delete;
-  raw_mode_context_basic &operator=(const raw_mode_context_basic &) = delete;
-  raw_mode_context_basic(raw_mode_context_basic &&) = delete;
-  raw_mode_context_basic &operator=(raw_mode_context_basic &&) = delete;
+  void carry(const char *begin, const char *end) noexcept {
+    const auto size =
+        std::min<size_t>(end - begin, max_sequence_size - sequence_size_);
+    std::copy(begin, begin + size, sequence_ + sequence_size_);
+    sequence_size_ += size;
+  }
 
-  ~raw_mode_context_basic() noexcept {
-    raw_mode_disable(&detail::orig_termios);
+  // Characters of the current sequence, [begin, end) being the part of it
+  // found in the current input
+  std::string_view sequence(const char *begin, const char *end) noexcept {
+    if (sequence_size_ == 0) {
+      return std::string_view{begin, end};
+    }
+    carry(begin, end);
+    return std::string_view{sequence_, sequence_size_};
   }
 
-  struct enable_mouse_t {
-    enable_mouse_t() noexcept {
-      ::dpsg::enable_mouse_tracking();
-      detail::require_mouse = true;
+  void clear_sequence() noexcept {
+    std::fill(std::begin(num_parameters_), std::end(num_parameters_), 0);
+    current_param_ = 0;
+    sub_parameter_ = 0;
+    key_event_type_ = 0;
+    result_ = event{};
+    expected_code_points_ = 0;
+    current_code_point_ = 0;
+    sequence_size_ = 0;
+  }
+
+  // Add a digit to the current parameter. The kitty keyboard protocol splits
+  // parameters with ':', the only part of interest beyond the first one is
+  // the event type following the modifiers. Alternate keys and text are
+  // dropped. Parameters too large for a u32 stay at its maximum rather than
+  // wrapping around to a valid value.
+  void parameter_digit(char c) noexcept {
+    constexpr u32 saturated = ~u32{0};
+    if (sub_parameter_ == 0) {
+      u32 &parameter = num_parameters_[current_param_];
+      parameter = parameter > (saturated - 9) / 10
+                      ? saturated
+                      : (parameter * 10) + (c - '0');
+    } else if (current_param_ == 1 && sub_parameter_ == 1) {
+      key_event_type_ = static_cast<u8>((key_event_type_ * 10) + (c - '0'));
     }
-    ~enable_mouse_t() noexcept {
-      ::dpsg::disable_mouse_tracking();
-      detail::require_mouse = false;
+  }
+
+  void next_sub_parameter() noexcept {
+    if (sub_parameter_ != 0xFF) {
+      ++sub_parameter_;
     }
-    enable_mouse_t(const enable_mouse_t &) noexcept = delete;
-    enable_mouse_t(enable_mouse_t &&) noexcept = delete;
-    const enable_mouse_t &operator=(const enable_mouse_t &) noexcept = delete;
-    const enable_mouse_t &operator=(enable_mouse_t &&) noexcept = delete;
-  };
+  }
 
-  [[nodiscard]] enable_mouse_t enable_mouse_tracking() { return {}; }
+  // Add a continuation character to the pending unicode character. Returns
+  // true once it is complete.
+  bool continue_code_point(char c) noexcept {
+    result_.get_key().data[++current_code_point_] = c;
+    expected_code_points_--;
 
-  [[nodiscard]] struct term_position cursor_position() const {
-    (void)this; // This is intentionally not static
-    constexpr static term_position invalid_pos = {(u16)0xFFFF, (u16)0xFFFF};
-    struct term_position p = {.col = 0, .row = 0};
-    char buf[32];
-    ssize_t i = 0; // Number of known characters in the buffer
-    query_cursor_position();
+    if (expected_code_points_ == 0) {
+      result_.get_key().mods =
+          result_.get_key().mods | event::key::modifiers::Unicode;
+      return true;
+    }
+    return false;
+  }
 
-    enum class state : char {
-      start,
-      esc,
-      bracket,
-      semicolon,
-      end
-    } state = state::start;
-    for (;;) {
-      const auto e = read(STDIN_FILENO, buf + i, sizeof(buf) - i);
-      if (e < 0) {
-        // There was an error
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          // But we can recover
-          continue;
-        } // We can't recover, return an invalid position
-        p = invalid_pos;
-        goto abort;
+  // Convert the run of plain characters starting at `begin`, up to `end`, to
+  // key events. Returns the number of events written to `out`.
+  size_t plain_text(const char *begin, const char *end, event *out) noexcept {
+    const size_t run = plain_character_run(begin, end);
+    for (size_t i = 0; i < run; ++i) {
+      out[i] = plain_key_event(begin[i]);
+    }
+    last_sequence_ = std::string_view{begin + run - 1, 1};
+    return run;
+  }
 
-      } else if (e == 0) [[unlikely]] {
-        // Not enough characters to form a valid response
-        p = invalid_pos;
-        goto abort;
-      } else [[likely]] {
-        // We need to extract the response from the buffer
-        // The response is of the form \033[<row>;<col>R
-        char *const end = buf + i + e;
-        char *begin = buf + i;
-        if (state == state::start) [[likely]] {
-          begin = std::find(begin, end, '\033');
-          if (begin == end) {
-            // No response yet
-            continue;
-          }
-          state = state::esc;
-          if (++begin == end) [[unlikely]] {
-            continue;
-          }
-        }
+  constexpr static inline u8 UPPER_BOUND_CTRL_CHARACTERS =
+      32; // 32 first values represent ctrl+<char>. 0 is ctrl+` for some reason
 
-        // consume the bracket, if not present, return an invalid position
-        if (state == state::esc) [[likely]] {
-          if (*begin != '[') [[unlikely]] {
-            // Not a valid response
-            p = invalid_pos;
+  // Return the expected amount of unicode continuation characters
+  static size_t from_character(char c, event::key::modifiers mod, event &out) {
+    // CTRL+<char> is sent as (<char> - 'A' + 1). For some reason, '`' is sent
+    // as 0.
+    if ((((u32)c >> 6) & 0b11) == 0b11) { // unicode continuation
+      out = event{event::key{(char)c, mod}};
+      return out.get_key().code_point_count() - 1;
+    }
+    if (c < UPPER_BOUND_CTRL_CHARACTERS) {
+      out = event{event::key{(char)(c == 0 ? '`' : c + 'a' - 1),
+                             mod | event::key::modifiers::Ctrl}};
+      return 0;
+    }
+
+    out = event{event::key{(char)c, mod}};
+    return 0;
+  };
+
+  static void parse_mouse(const u32 *numbers, event::mouse::modifiers mods,
+                          event &ev) {
+    auto magic = (event::mouse::modifiers)numbers[0];
+    auto x = static_cast<u16>(numbers[1]);
+    auto y = static_cast<u16>(numbers[2]);
+    event::mouse mouse{mods | magic, {.x = x, .y = y}};
+    // Releases are reported with 'm', motion with 'M' and the same bit set
+    mouse.motion = mods == event::mouse::modifiers::None &&
+                   (magic & event::mouse::modifiers::Release) !=
+                       event::mouse::modifiers::None;
+    ev = mouse;
+  }
+
+  // `modifiers` is 1 + a bit set of Shift (1), Alt (2) and Ctrl (4). The
+  // other modifiers of the kitty keyboard protocol are ignored.
+  event parse_function_key(char c, event base, u32 modifiers) const noexcept {
+    base.get_key().code = c;
+    const u32 pressed = modifiers == 0 ? 0 : modifiers - 1;
+    auto &mods = base.get_key().mods;
+    if ((pressed & 1) != 0) {
+      mods = mods | event::key::modifiers::Shift;
+    }
+    if ((pressed & 2) != 0) {
+      mods = mods | event::key::modifiers::Alt;
+    }
+    if ((pressed & 4) != 0) {
+      mods = mods | event::key::modifiers::Ctrl;
+    }
+    if (key_event_type_ == 2 || key_event_type_ == 3) {
+      base.get_key().kind = (event::key::kinds)(key_event_type_ - 1);
+    }
+    return base;
+  }
+
+  // Home or End from ^[[H and ^[[F, or ^[[1;<modifiers>H and F as sent with
+  // modifiers or by the kitty keyboard protocol
+  event parse_home_end(char c, u32 modifiers) const noexcept {
+    const event::key key = c == 'H' ? term_events::home : term_events::end;
+    return parse_function_key(key.code, key, modifiers);
+  }
+
+  // ^[[<code>;<modifiers>u, from the kitty keyboard protocol. `code` is a
+  // unicode code point, keys without a character of their own (Esc, Enter,
+  // Tab, Backspace) are sent as their legacy value.
+  static constexpr bool is_kitty_key_code(u32 code) noexcept {
+    constexpr u32 surrogates_start = 0xD800;
+    constexpr u32 surrogates_end = 0xDFFF;
+    constexpr u32 last_code_point = 0x10FFFF;
+    return code != 0 && code <= last_code_point &&
+           (code < surrogates_start || code > surrogates_end);
+  }
+
+  event parse_kitty_key(u32 code, u32 modifiers) const noexcept {
+    constexpr u32 private_use_start = 0xE000;
+    constexpr u32 private_use_end = 0xF8FF;
+    event base;
+    switch (code) {
+    case '\r':
+      base = term_events::enter;
+      break;
+    case '\033':
+      base = term_events::esc;
+      break;
+    case '\t':
+    case 127:
+      from_character((char)code, event::key::modifiers::None, base);
+      break;
+    default:
+      if (code >= private_use_start && code <= private_use_end) {
+        base = term_events::extended_key(static_cast<u16>(code));
+      } else if (code < 0x80) {
+        base = event::key{(char)code};
+      } else {
+        base = event::key{char{}, event::key::modifiers::Unicode};
+        auto &key = base.get_key();
+        if (code < 0x800) {
+          key.data[0] = (char)(0xC0 | (code >> 6));
+          key.data[1] = (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+          key.data[0] = (char)(0xE0 | (code >> 12));
+          key.data[1] = (char)(0x80 | ((code >> 6) & 0x3F));
+          key.data[2] = (char)(0x80 | (code & 0x3F));
+        } else {
+          key.data[0] = (char)(0xF0 | ((code >> 18) & 0x07));
+          key.data[1] = (char)(0x80 | ((code >> 12) & 0x3F));
+          key.data[2] = (char)(0x80 | ((code >> 6) & 0x3F));
+          key.data[3] = (char)(0x80 | (code & 0x3F));
+        }
+      }
+    }
+    // parse_function_key() overwrites the code with its first argument
+    return parse_function_key(base.get_key().code, base, modifiers);
+  }
+};
+} // namespace detail
+
+// Incremental parser for the input of a terminal. Characters can come from
+// anywhere (stdin, a pty master, a file, a test buffer...) in chunks of any
+// size: the state of the parse is kept between calls, so a sequence split
+// across several chunks is recognized as if it had come in one piece.
+class input_parser : public detail::input_parser_base<input_parser> {
+public:
+  // Parse `input` and write the complete events to `out`. Parsing stops early
+  // when `out` is full, and right after a paste or a cursor report so that
+  // last_sequence() and cursor_position() describe it. The caller is
+  // expected to call parse() again with the characters that weren't
+  // consumed.
+  parse_result parse(std::span<const char> input, std::span<event> out) {
+    const char *const buffer = input.data();
+    const size_t last = input.size();
+    size_t current = 0; // Index of the current character in the buffer
+    size_t start_of_new_sequence =
+        0; // Where is the start of the current control sequence
+    size_t count = 0;
+
+    // Characters of the current sequence, including those carried over from
+    // the previous calls
+    const auto current_sequence = [&] {
+      return sequence(buffer + start_of_new_sequence, buffer + current);
+    };
+    const auto finalize_parse = [&] {
+      finalize();
+      start_of_new_sequence = current;
+    };
+    const auto emit = [&] {
+      last_sequence_ = current_sequence();
+      out[count++] = result_;
+      finalize_parse();
+    };
+    // Malformed sequences are reported in band, once the rest of the
+    // sequence is skipped, see event::error
+    const auto end_malformed = [&](char c) {
+      switch (end_of_malformed(result_.get_error().reason, c)) {
+      case malformed_end::here:
+        emit();
+        break;
+      case malformed_end::before:
+        --current;
+        emit();
+        break;
+      case malformed_end::further:
+        state_ = parse_state::skipping_control_sequence;
+        break;
+      }
+    };
+    const auto emit_error = [&](event::error::reasons reason, char c) {
+      result_ = event::error{reason, c};
+      end_malformed(c);
+    };
+
+    // BEGIN LOOP_OVER_BUFFER
+    while (current < last && count < out.size()) {
+      if (pasting_) {
+        bool part = false;
+        current += continue_paste(buffer + current, buffer + last, part);
+        start_of_new_sequence = current;
+        if (part) {
+          // Stop right after the paste, so that last_sequence() is its text
+          out[count++] = event::paste{.more = pasting_};
+          break;
+        }
+        continue;
+      }
+
+      if (state_ == parse_state::expecting_first &&
+          expected_code_points_ == 0 &&
+          detail::is_plain_character(buffer[current])) {
+        // Fast path for plain text: find the whole run at once and turn it
+        // into key events without going through the FSM
+        const size_t run = plain_text(
+            buffer + current,
+            buffer + std::min(last, current + (out.size() - count)),
+            out.data() + count);
+        count += run;
+        current += run;
+        start_of_new_sequence = current;
+        continue;
+      }
+
+      char c = buffer[current++];
+
+      if (expected_code_points_ != 0) {
+        if (continue_code_point(c)) {
+          emit();
+        }
+        continue;
+      }
+
+      switch (state_) {
+
+      case parse_state::expecting_first: {
+        if (c == '\033') {
+          // Control character, expect this to be a control sequence
+          // If it isn't (ESC or Alt char), the input will end there, and
+          // we'll deal with the event in flush()
+          state_ = parse_state::expecting_control_character;
+        } else {
+          expected_code_points_ =
+              from_character(c, event::key::modifiers::None, result_);
+          if (expected_code_points_ == 0) {
+            emit();
+          }
+        }
+        break;
+      } // parse_state::expecting_first:
+
+      case parse_state::expecting_control_character: {
+        switch (c) {
+        case '[': { // Control !
+          state_ = parse_state::expecting_control_sequence;
+          control_character_ = c;
+          break;
+        }
+        case 'O': {
+          state_ = parse_state::expecting_sun_function_key;
+          break;
+        }
+        default: {
+          expected_code_points_ =
+              from_character(c, event::key::modifiers::Alt, result_);
+          if (expected_code_points_ == 0) {
+            emit();
+          }
+        }
+        }
+        break;
+      } // parse_state::expecting_control_character
+
+      case parse_state::expecting_control_sequence: {
+        if (isdigit(c)) {
+          state_ = parse_state::parsing_number;
+          num_parameters_[current_param_] = c - '0';
+        } else {
+          switch (c) {
+          case '<': { // mouse sequence
+            state_ = parse_state::parsing_number;
+            break;
+          }
+          case 'A': {
+            result_ = term_events::arrow_up;
+            emit();
+            break;
+          }
+          case 'B': {
+            result_ = term_events::arrow_down;
+            emit();
+            break;
+          }
+          case 'C': {
+            result_ = term_events::arrow_right;
+            emit();
+            break;
+          }
+          case 'D': {
+            result_ = term_events::arrow_left;
+            emit();
+            break;
+          }
+          case 'H':
+          case 'F': {
+            result_ = parse_home_end(c, 1);
+            emit();
+            break;
+          }
+          default: {
+            emit_error(event::error::reasons::invalid_sequence_start, c);
+            break;
+          }
+          }
+        }
+        break;
+      } // case parse_state::expecting_control_sequence
+
+      case parse_state::parsing_number: {
+        u32 *const num_parameters = num_parameters_;
+        u32 *const current_param = num_parameters_ + current_param_;
+        if (isdigit(c)) {
+          parameter_digit(c);
+        } else {
+          switch (c) {
+          case ';': {
+            if (current_param_ + 1 == 4) {
+              // More than 4 numeric characters in terminal control sequence
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            current_param_++;
+            sub_parameter_ = 0;
+            break;
+          }
+          case ':': {
+            next_sub_parameter();
+            break;
+          }
+          case 'u': { // Kitty keyboard protocol
+            if (current_param > num_parameters + 2 ||
+                !is_kitty_key_code(num_parameters[0])) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_kitty_key(
+                num_parameters[0],
+                (current_param >= num_parameters + 1) ? num_parameters[1] : 1);
+            emit();
+            break;
+          }
+          case 'm': {
+            if (current_param != num_parameters + 2) {
+              // Mouse events require exactly 3 values
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            parse_mouse(num_parameters, event::mouse::modifiers::Release,
+                        result_);
+            emit();
+            break;
+          }
+          case 'M': {
+            if (current_param != num_parameters + 2) {
+              // Mouse events require exactly 3 values
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            parse_mouse(num_parameters, event::mouse::modifiers::None,
+                        result_);
+            emit();
+            break;
+          }
+          case 'A': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::arrow_up,
+                                         num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'B': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::arrow_down,
+                                         num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'C': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::arrow_right,
+                                         num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'D': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::arrow_left,
+                                         num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'H':
+          case 'F': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_home_end(c, num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'P': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::f1, num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'Q': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::f2, num_parameters[1]);
+            emit();
+            break;
+          }
+          case 'R': {
+            if (current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+            } else if (num_parameters[0] == 1 && !expect_cursor_report_) {
+              result_ =
+                  parse_function_key(c, term_events::f3, num_parameters[1]);
+              emit();
+            } else { // Cursor position
+              cursor_position_ =
+                  term_position{.x = static_cast<u16>(num_parameters[1]),
+                                .y = static_cast<u16>(num_parameters[0])};
+              result_ = event::cursor_report{};
+              emit();
+              // Stop right after the report, so that cursor_position() is
+              // its position
+              return {current, count};
+            }
+            break;
+          }
+          case 'S': {
+            if (num_parameters[0] != 1 || current_param != num_parameters + 1) {
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            result_ = parse_function_key(c, term_events::f4, num_parameters[1]);
+            emit();
+            break;
+          }
+          case '~': { // extension function key
+            if (current_param > num_parameters + 1) {
+              // Unknown numeric sequence for extended function key
+              emit_error(event::error::reasons::invalid_parameters, c);
+              break;
+            }
+            if (current_param == num_parameters) {
+              if (num_parameters[0] == paste_start_code) {
+                finalize_parse();
+                start_paste();
+                break;
+              }
+              if (num_parameters[0] == paste_end_code) {
+                // Stray end of paste, nothing to report
+                finalize_parse();
+                break;
+              }
+            }
+
+            result_ = parse_function_key(
+                (char)num_parameters[0],
+                // This doesn't matter, the actual code is drawn from the
+                // first parameter
+                term_events::f4,
+                // If we didn't get a modifier key, send 1 (no mod)
+                (current_param == num_parameters + 1) ? num_parameters[1]
+
+                                                      : 1);
+            emit();
+            break;
+          }
+          default: {
+            emit_error(event::error::reasons::unfinished_numeric_sequence, c);
+            break;
+          }
+          } // switch(c)
+          break;
+        }
+        break;
+      } // case parse_state::parsing_number
+      case parse_state::expecting_sun_function_key: {
+        switch (c) {
+        case 'P':
+          result_ = term_events::f1;
+          emit();
+          break;
+        case 'Q':
+          result_ = term_events::f2;
+          emit();
+          break;
+        case 'R':
+          result_ = term_events::f3;
+          emit();
+          break;
+        case 'S':
+          result_ = term_events::f4;
+          emit();
+          break;
+        default: {
+          emit_error(event::error::reasons::invalid_function_key, c);
+          break;
+        }
+        }
+        break;
+      } // case parse_state::expecting_sun_function_key
+
+      case parse_state::expecting_unicode: {
+        break; // Unused, unicode continuations are handled above
+      }
+
+      case parse_state::skipping_control_sequence: {
+        end_malformed(c);
+        break;
+      }
+
+      } // switch(state)
+
+    } // END LOOP_OVER_BUFFER
+
+    // The rest of the sequence will come with the next input, keep what we
+    // have so far to report it once it's complete
+    if (pending()) {
+      carry(buffer + start_of_new_sequence, buffer + current);
+    }
+
+    return {current, count};
+  }
+
+  // Alt keys are sent as ^[<char>. If events come really fast, or
+  // accumulate in the input a long time, it may be difficult to
+  // differentiate between the start of a control sequence and a regular
+  // Alt/Esc char. Call this once the caller is confident that no more
+  // characters are coming for now to resolve a lone ^[ or ^[[ into Esc or
+  // Alt+[. Writes at most one event to `out` and returns the number of events
+  // written.
+  size_t flush(std::span<event> out) {
+    assert(!out.empty());
+    if (expected_code_points_ != 0) {
+      return 0; // The rest of the unicode character is still missing
+    }
+    switch (state_) {
+    case parse_state::expecting_control_sequence: {
+      // This is a legitimate Alt char.
+      from_character(control_character_, event::key::modifiers::Alt, result_);
+      break;
+    }
+    case parse_state::expecting_control_character: {
+      // Legitimate Esc
+      result_ = event::key{'\033'};
+      break;
+    }
+    default:
+      // Either we're not in the middle of a parse, or the result is entirely
+      // determined by what follows
+      return 0;
+    }
+    last_sequence_ = std::string_view{sequence_, sequence_size_};
+    out[0] = result_;
+    finalize();
+    return 1;
+  }
+
+  // Is there an unfinished sequence waiting for more input?
+  [[nodiscard]] bool pending() const noexcept {
+    return state_ != parse_state::expecting_first || expected_code_points_ != 0 ||
+           pasting_;
+  }
+
+  // Forget about any unfinished sequence
+  void reset() noexcept {
+    finalize();
+    pasting_ = false;
+  }
+
+private:
+  enum class parse_state : u8 {
+    expecting_first,
+    expecting_control_character,
+    expecting_control_sequence,
+    parsing_number,
+    expecting_unicode,
+    expecting_sun_function_key,
+    skipping_control_sequence, // Malformed, the error is reported at its end
+  };
+
+  parse_state state_{parse_state::expecting_first}; // FSM state
+  char control_character_ = 0; // What's the character right after ^[
+
+  void finalize() noexcept {
+    // Reset state for the next parse
+    state_ = parse_state::expecting_first;
+    clear_sequence();
+  }
+};
+
+namespace detail::input_dfa {
+// Tables driving table_input_parser
+
+enum class parse_state : u8 {
+  ground,           // Not in a sequence
+  escape,           // After ^[
+  control_sequence, // After ^[[
+  parameters,       // After ^[[ and a digit, or ^[[<
+  sun_function_key, // After ^[O
+  malformed,        // In a malformed control sequence, up to its end
+  count,
+};
+
+enum class character_class : u8 {
+  other,
+  escape,      // ^[
+  bracket,     // [
+  letter_o,    // O, introduces sun function keys
+  less_than,   // <, introduces SGR mouse sequences
+  digit,       // 0-9
+  semicolon,   // ;
+  colon,       // :, separates the parts of a kitty parameter
+  arrow,       // A-D
+  home_end,    // H and F
+  function,    // P-S
+  tilde,       // ~
+  mouse_press, // M
+  mouse_release, // m
+  letter_u,    // u, ends kitty keyboard sequences
+  count,
+};
+
+enum class parse_action : u8 {
+  none,
+  key,
+  alt_key,
+  parameter_digit,
+  next_parameter,
+  next_sub_parameter,
+  arrow_key,
+  home_end_key,
+  modified_home_end_key,
+  function_key,
+  extended_function_key,
+  sun_function_key,
+  mouse_press,
+  mouse_release,
+  kitty_key,
+  invalid_sequence_start,
+  unfinished_numeric_sequence,
+  invalid_function_key,
+  skip_malformed,
+};
+
+struct transition {
+  parse_state state;
+  parse_action action;
+};
+
+constexpr size_t state_count = static_cast<size_t>(parse_state::count);
+constexpr size_t class_count =
+    static_cast<size_t>(character_class::count);
+
+using class_table = std::array<character_class, 256>;
+using transition_table =
+    std::array<std::array<transition, class_count>, state_count>;
+
+constexpr class_table make_character_classes() noexcept {
+  class_table table{};
+  const auto set = [&](char c, character_class cls) {
+    table[static_cast<u8>(c)] = cls;
+  };
+  for (auto &cls : table) {
+    cls = character_class::other;
+  }
+  set('\033', character_class::escape);
+  set('[', character_class::bracket);
+  set('O', character_class::letter_o);
+  set('<', character_class::less_than);
+  for (char c = '0'; c <= '9'; ++c) {
+    set(c, character_class::digit);
+  }
+  set(';', character_class::semicolon);
+  set(':', character_class::colon);
+  for (char c = 'A'; c <= 'D'; ++c) {
+    set(c, character_class::arrow);
+  }
+  set('H', character_class::home_end);
+  set('F', character_class::home_end);
+  for (char c = 'P'; c <= 'S'; ++c) {
+    set(c, character_class::function);
+  }
+  set('~', character_class::tilde);
+  set('M', character_class::mouse_press);
+  set('m', character_class::mouse_release);
+  set('u', character_class::letter_u);
+  return table;
+}
+
+constexpr transition_table make_transitions() noexcept {
+  transition_table table{};
+  const auto on = [&](parse_state from, character_class cls, parse_state to,
+                      parse_action action) {
+    table[static_cast<size_t>(from)][static_cast<size_t>(cls)] = {to,
+                                                                   action};
+  };
+  const auto by_default = [&](parse_state from, parse_state to,
+                              parse_action action) {
+    for (auto &t : table[static_cast<size_t>(from)]) {
+      t = {to, action};
+    }
+  };
+  using enum character_class;
+  constexpr auto ground = parse_state::ground;
+
+  // Regular characters, Ctrl+<char> and the first byte of unicode
+  // characters are all handled by from_character()
+  by_default(ground, ground, parse_action::key);
+  on(ground, escape, parse_state::escape, parse_action::none);
+
+  // Alt keys are sent as ^[<char>
+  by_default(parse_state::escape, ground, parse_action::alt_key);
+  on(parse_state::escape, bracket, parse_state::control_sequence,
+     parse_action::none);
+  on(parse_state::escape, letter_o, parse_state::sun_function_key,
+     parse_action::none);
+
+  by_default(parse_state::control_sequence, ground,
+             parse_action::invalid_sequence_start);
+  on(parse_state::control_sequence, digit, parse_state::parameters,
+     parse_action::parameter_digit);
+  on(parse_state::control_sequence, less_than, parse_state::parameters,
+     parse_action::none);
+  on(parse_state::control_sequence, arrow, ground, parse_action::arrow_key);
+  on(parse_state::control_sequence, home_end, ground,
+     parse_action::home_end_key);
+
+  by_default(parse_state::parameters, ground,
+             parse_action::unfinished_numeric_sequence);
+  on(parse_state::parameters, digit, parse_state::parameters,
+     parse_action::parameter_digit);
+  on(parse_state::parameters, semicolon, parse_state::parameters,
+     parse_action::next_parameter);
+  on(parse_state::parameters, colon, parse_state::parameters,
+     parse_action::next_sub_parameter);
+  on(parse_state::parameters, arrow, ground, parse_action::function_key);
+  on(parse_state::parameters, home_end, ground,
+     parse_action::modified_home_end_key);
+  on(parse_state::parameters, function, ground, parse_action::function_key);
+  on(parse_state::parameters, tilde, ground,
+     parse_action::extended_function_key);
+  on(parse_state::parameters, mouse_press, ground, parse_action::mouse_press);
+  on(parse_state::parameters, mouse_release, ground,
+     parse_action::mouse_release);
+  on(parse_state::parameters, letter_u, ground, parse_action::kitty_key);
+
+  by_default(parse_state::sun_function_key, ground,
+             parse_action::invalid_function_key);
+  on(parse_state::sun_function_key, function, ground,
+     parse_action::sun_function_key);
+
+  // The action finds where the sequence ends, the state only changes once
+  // the error is reported
+  by_default(parse_state::malformed, parse_state::malformed,
+             parse_action::skip_malformed);
+
+  return table;
+}
+
+constexpr inline class_table character_classes =
+    make_character_classes();
+constexpr inline transition_table transitions = make_transitions();
+} // namespace detail::input_dfa
+
+// Same as input_parser, but the escape sequences are recognized by a DFA
+// driven by transition tables computed at compile time rather than by nested
+// switches. The events produced are identical. Each character is classified
+// with one lookup, the next state and the action to perform with another, so
+// mixed input only branches on the action.
+class table_input_parser
+    : public detail::input_parser_base<table_input_parser> {
+public:
+  // Parse `input` and write the complete events to `out`. Parsing stops early
+  // when `out` is full, and right after a paste or a cursor report so that
+  // last_sequence() and cursor_position() describe it. The caller is
+  // expected to call parse() again with the characters that weren't
+  // consumed.
+  parse_result parse(std::span<const char> input, std::span<event> out) {
+    const char *const buffer = input.data();
+    const size_t last = input.size();
+    size_t current = 0; // Index of the current character in the buffer
+    size_t start_of_new_sequence =
+        0; // Where is the start of the current control sequence
+    size_t count = 0;
+
+    const auto current_sequence = [&] {
+      return sequence(buffer + start_of_new_sequence, buffer + current);
+    };
+    const auto finalize_parse = [&] {
+      finalize();
+      start_of_new_sequence = current;
+    };
+    const auto emit = [&] {
+      last_sequence_ = current_sequence();
+      out[count++] = result_;
+      finalize_parse();
+    };
+    // Malformed sequences are reported in band, once the rest of the
+    // sequence is skipped, see event::error
+    const auto end_malformed = [&](char c) {
+      switch (end_of_malformed(result_.get_error().reason, c)) {
+      case malformed_end::here:
+        emit();
+        break;
+      case malformed_end::before:
+        --current;
+        emit();
+        break;
+      case malformed_end::further:
+        state_ = parse_state::malformed;
+        break;
+      }
+    };
+    const auto emit_error = [&](event::error::reasons reason, char c) {
+      result_ = event::error{reason, c};
+      end_malformed(c);
+    };
+
+    while (current < last && count < out.size()) {
+      if (pasting_) {
+        bool part = false;
+        current += continue_paste(buffer + current, buffer + last, part);
+        start_of_new_sequence = current;
+        if (part) {
+          // Stop right after the paste, so that last_sequence() is its text
+          out[count++] = event::paste{.more = pasting_};
+          break;
+        }
+        continue;
+      }
+
+      if (state_ == parse_state::ground && expected_code_points_ == 0 &&
+          detail::is_plain_character(buffer[current])) {
+        const size_t run = plain_text(
+            buffer + current,
+            buffer + std::min(last, current + (out.size() - count)),
+            out.data() + count);
+        count += run;
+        current += run;
+        start_of_new_sequence = current;
+        continue;
+      }
+
+      char c = buffer[current++];
+
+      if (expected_code_points_ != 0) {
+        if (continue_code_point(c)) {
+          emit();
+        }
+        continue;
+      }
+
+      const transition next =
+          detail::input_dfa::transitions[static_cast<u8>(state_)][static_cast<u8>(
+              detail::input_dfa::character_classes[static_cast<u8>(c)])];
+      state_ = next.state;
+
+      switch (next.action) {
+      case parse_action::none:
+        break;
+      case parse_action::key:
+        expected_code_points_ =
+            from_character(c, event::key::modifiers::None, result_);
+        if (expected_code_points_ == 0) {
+          emit();
+        }
+        break;
+      case parse_action::alt_key:
+        expected_code_points_ =
+            from_character(c, event::key::modifiers::Alt, result_);
+        if (expected_code_points_ == 0) {
+          emit();
+        }
+        break;
+      case parse_action::parameter_digit:
+        parameter_digit(c);
+        break;
+      case parse_action::next_parameter:
+        if (current_param_ + 1 == 4) {
+          // More than 4 numeric characters in terminal control sequence
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        current_param_++;
+        sub_parameter_ = 0;
+        break;
+      case parse_action::next_sub_parameter:
+        next_sub_parameter();
+        break;
+      case parse_action::arrow_key:
+      case parse_action::sun_function_key:
+        result_ = event::key{c, event::key::modifiers::Special};
+        emit();
+        break;
+      case parse_action::home_end_key:
+        result_ = parse_home_end(c, 1);
+        emit();
+        break;
+      case parse_action::modified_home_end_key:
+        if (num_parameters_[0] != 1 || current_param_ != 1) {
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        result_ = parse_home_end(c, num_parameters_[1]);
+        emit();
+        break;
+      case parse_action::function_key:
+        if (c == 'R' && current_param_ == 1 &&
+            (num_parameters_[0] != 1 || expect_cursor_report_)) {
+          // Cursor position
+          cursor_position_ =
+              term_position{.x = static_cast<u16>(num_parameters_[1]),
+                            .y = static_cast<u16>(num_parameters_[0])};
+          result_ = event::cursor_report{};
+          emit();
+          // Stop right after the report, so that cursor_position() is its
+          // position
+          return {current, count};
+        }
+        if (num_parameters_[0] != 1 || current_param_ != 1) {
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        result_ =
+            parse_function_key(c, event::key{c, event::key::modifiers::Special},
+                               num_parameters_[1]);
+        emit();
+        break;
+      case parse_action::extended_function_key:
+        if (current_param_ > 1) {
+          // Unknown numeric sequence for extended function key
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        if (current_param_ == 0 && num_parameters_[0] == paste_start_code) {
+          finalize_parse();
+          start_paste();
+          break;
+        }
+        if (current_param_ == 0 && num_parameters_[0] == paste_end_code) {
+          // Stray end of paste, nothing to report
+          finalize_parse();
+          break;
+        }
+        result_ = parse_function_key(
+            (char)num_parameters_[0], term_events::f4,
+            // If we didn't get a modifier key, send 1 (no mod)
+            (current_param_ == 1) ? num_parameters_[1] : 1);
+        emit();
+        break;
+      case parse_action::mouse_press:
+      case parse_action::mouse_release:
+        if (current_param_ != 2) {
+          // Mouse events require exactly 3 values
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        parse_mouse(num_parameters_,
+                    next.action == parse_action::mouse_release
+                        ? event::mouse::modifiers::Release
+                        : event::mouse::modifiers::None,
+                    result_);
+        emit();
+        break;
+      case parse_action::kitty_key:
+        if (current_param_ > 2 || !is_kitty_key_code(num_parameters_[0])) {
+          emit_error(event::error::reasons::invalid_parameters, c);
+          break;
+        }
+        result_ = parse_kitty_key(num_parameters_[0],
+                                  current_param_ >= 1 ? num_parameters_[1] : 1);
+        emit();
+        break;
+      case parse_action::invalid_sequence_start:
+        emit_error(event::error::reasons::invalid_sequence_start, c);
+        break;
+      case parse_action::unfinished_numeric_sequence:
+        emit_error(event::error::reasons::unfinished_numeric_sequence, c);
+        break;
+      case parse_action::invalid_function_key:
+        emit_error(event::error::reasons::invalid_function_key, c);
+        break;
+      case parse_action::skip_malformed:
+        end_malformed(c);
+        break;
+      }
+    }
+
+    // The rest of the sequence will come with the next input, keep what we
+    // have so far to report it once it's complete
+    if (pending()) {
+      carry(buffer + start_of_new_sequence, buffer + current);
+    }
+
+    return {current, count};
+  }
+
+  // See input_parser::flush()
+  size_t flush(std::span<event> out) {
+    assert(!out.empty());
+    if (expected_code_points_ != 0) {
+      return 0; // The rest of the unicode character is still missing
+    }
+    switch (state_) {
+    case parse_state::control_sequence: {
+      // This is a legitimate Alt char.
+      from_character('[', event::key::modifiers::Alt, result_);
+      break;
+    }
+    case parse_state::escape: {
+      // Legitimate Esc
+      result_ = event::key{'\033'};
+      break;
+    }
+    default:
+      // Either we're not in the middle of a parse, or the result is entirely
+      // determined by what follows
+      return 0;
+    }
+    last_sequence_ = std::string_view{sequence_, sequence_size_};
+    out[0] = result_;
+    finalize();
+    return 1;
+  }
+
+  // Is there an unfinished sequence waiting for more input?
+  [[nodiscard]] bool pending() const noexcept {
+    return state_ != parse_state::ground || expected_code_points_ != 0 ||
+           pasting_;
+  }
+
+  // Forget about any unfinished sequence
+  void reset() noexcept {
+    finalize();
+    pasting_ = false;
+  }
+
+private:
+  using parse_state = detail::input_dfa::parse_state;
+  using parse_action = detail::input_dfa::parse_action;
+  using transition = detail::input_dfa::transition;
+
+  parse_state state_{parse_state::ground}; // DFA state
+
+  void finalize() noexcept {
+    // Reset state for the next parse
+    state_ = parse_state::ground;
+    clear_sequence();
+  }
+};
+
+namespace detail {
+
+constexpr static inline std::initializer_list<int> HANDLED_SIGNALS = {
+    SIGINT, SIGSEGV, SIGTERM, SIGILL, SIGFPE, SIGABRT};
+constexpr static inline auto MAX_SIGNAL =
+    HANDLED_SIGNALS.size() + 3; // SIGCONT, SIGTSTP & SIGWINCH
+constexpr static inline auto INDEX_HANDLER_SIGTSTP = MAX_SIGNAL - 1;
+constexpr static inline auto INDEX_HANDLER_SIGCONT = INDEX_HANDLER_SIGTSTP - 1;
+constexpr static inline auto INDEX_HANDLER_SIGWINCH = INDEX_HANDLER_SIGCONT - 1;
+constexpr size_t index_of(int signal) {
+  size_t i = 0;
+  for (auto sig : HANDLED_SIGNALS) {
+    if (sig == signal) {
+      return i;
+    }
+    ++i;
+  }
+  return -1; // Just don't let it happen
+}
+extern struct sigaction new_sa[MAX_SIGNAL], old_sa[MAX_SIGNAL];
+extern struct termios orig_termios;
+extern bool require_mouse;
+extern bool require_bracketed_paste;
+extern u8 kitty_keyboard_flags; // 0 when the protocol isn't enabled
+
+// Size of the terminal as of the last SIGWINCH, columns in the high half
+extern std::atomic<u32> cached_terminal_size;
+static_assert(std::atomic<u32>::is_always_lock_free,
+              "cached_terminal_size is updated from a signal handler");
+// Written to from the SIGWINCH handler to wake up the streams
+extern int resize_pipe[2];
+// Whether a raw_mode_context_basic exists, they all share the above
+extern bool raw_mode_active;
+
+inline void update_terminal_size() noexcept {
+  struct winsize w;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
+    return;
+  }
+  cached_terminal_size.store((u32{w.ws_col} << 16) | w.ws_row,
+                             std::memory_order_relaxed);
+}
+
+inline void notify_resize() noexcept {
+  const int saved_errno = errno;
+  update_terminal_size();
+  const char c = 0;
+  // Nothing to do if the pipe is full, the streams will wake up anyway
+  [[maybe_unused]] auto _ = write(resize_pipe[1], &c, 1);
+  errno = saved_errno;
+}
+
+// Deadline after which a pending ^[ is resolved into Esc/Alt+[ by the
+// streams. Armed after every read leaving an unfinished sequence behind.
+class escape_timer {
+  using clock = std::chrono::steady_clock;
+  clock::time_point deadline_{};
+  bool armed_ = false;
+
+public:
+  void arm(int timeout_ms) noexcept {
+    deadline_ = clock::now() + std::chrono::milliseconds{timeout_ms};
+    armed_ = true;
+  }
+
+  void disarm() noexcept { armed_ = false; }
+
+  [[nodiscard]] bool armed() const noexcept { return armed_; }
+
+  // After a read: wait `timeout_ms` for the rest of the sequence `parser` is
+  // in the middle of, if any
+  template <class Parser>
+  void update(const Parser &parser, int timeout_ms) noexcept {
+    if (parser.pending()) {
+      arm(timeout_ms);
+    } else {
+      disarm();
+    }
+  }
+
+  [[nodiscard]] bool expired() const noexcept {
+    return armed_ && clock::now() >= deadline_;
+  }
+
+  // Timeout to pass to poll(): whatever is left before the deadline if
+  // armed, `otherwise` if not
+  [[nodiscard]] int poll_timeout(int otherwise) const noexcept {
+    if (!armed_) {
+      return otherwise;
+    }
+    const auto left = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline_ - clock::now());
+    return std::max(0, static_cast<int>(left.count()));
+  }
+};
+} // namespace detail
+
+// How long the streams wait for the rest of a sequence before deciding that
+// a lone ^[ was an Esc key press, in milliseconds
+constexpr static inline int default_escape_timeout = 5;
+
+// Latency policy of raw_mode_context_basic recording nothing, the default.
+// Its hooks are empty, so the streams compile to what they'd be without them.
+struct no_input_latency {
+  static void on_read() noexcept {}
+  static void on_yield() noexcept {}
+  static void on_resume() noexcept {}
+};
+
+// Latency policy of raw_mode_context_basic timing the input path of the
+// streams with the monotonic clock:
+// - `parse` goes from the completion of a read() to the yield of an event
+//   (or a batch) parsed from it. It covers parsing, waiting behind earlier
+//   events of the same read, and the escape timeout of a lone ^[.
+// - `handle` goes from a yield to the stream being resumed, i.e. the time
+//   the application spends on an event.
+// Time spent in the kernel and waiting in poll() is what's left of the
+// latency seen by the user.
+class input_latency {
+public:
+  using clock = std::chrono::steady_clock;
+
+  latency_histogram<> parse;
+  latency_histogram<> handle;
+
+  // When the read() that produced the current event completed
+  [[nodiscard]] clock::time_point read_time() const noexcept { return read_; }
+
+  // When the current event was yielded
+  [[nodiscard]] clock::time_point yield_time() const noexcept {
+    return yielded_;
+  }
+
+  void reset() noexcept {
+    parse.reset();
+    handle.reset();
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const input_latency &l) {
+    return os << "parse: " << l.parse << "\nhandle: " << l.handle << '\n';
+  }
+
+  void on_read() noexcept { read_ = clock::now(); }
+
+  void on_yield() noexcept {
+    yielded_ = clock::now();
+    parse.record(yielded_ - read_);
+  }
+
+  void on_resume() noexcept { handle.record(clock::now() - yielded_); }
+
+private:
+  clock::time_point read_{};
+  clock::time_point yielded_{};
+};
+
+namespace detail {
+// What the input of a terminal told us so far and what we asked it, shared by
+// raw_mode_context_basic and terminal_session. Parser is the backend used to
+// parse the input, either input_parser or table_input_parser.
+template <class Parser> class terminal_base {
+public:
+  // Have batched_event_stream() collapse consecutive mouse motion events
+  // within a batch, see ::dpsg::coalesce_mouse_motion(). Disabled by default.
+  void coalesce_mouse_motion(bool enable) noexcept {
+    coalesce_mouse_motion_ = enable;
+  }
+
+  // Merge identical key events following each other in a read into the
+  // first one, counting them in key::repeats. The characters reported with
+  // a merged event are those of all its copies. Disabled by default.
+  void collapse_key_repeats(bool enable) noexcept {
+    collapse_key_repeats_ = enable;
+  }
+
+  // Text of the last paste event, or of the part of the paste it reports,
+  // see event::is_partial_paste_event(). Only valid until the next event is
+  // read.
+  [[nodiscard]] std::string_view pasted_text() const noexcept {
+    return pasted_text_;
+  }
+
+  // Append everything read from the terminal to `recorder` from now on, or
+  // stop recording if null. The recorder must outlive the recording.
+  void record_input(input_recorder *recorder) noexcept {
+    recorder_ = recorder;
+  }
+
+  // Ask the terminal where the cursor is, without waiting for the answer.
+  // The answer goes through the input like anything else: it is delivered
+  // as a cursor report event, and fulfills the future. Queries are answered
+  // in the order they were made.
+  [[nodiscard]] std::future<term_position> request_cursor_position() {
+    auto answer = cursor_queries_.emplace_back().get_future();
+    ::dpsg::query_cursor_position(output_fd_);
+    return answer;
+  }
+
+  // Parse `input`, read from the terminal by the caller, and call `on_event`
+  // with every event and the characters that produced it, keeping track of
+  // the cursor, pastes and queries. This is for event loops that wait on the
+  // terminal themselves, see reactor.
+  template <class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  void process_input(Parser &parser, std::span<const char> input,
+                     F &&on_event) {
+    record(input);
+    event ev;
+    std::string_view sequence;
+    while (next_event(parser, input, ev, sequence)) {
+      on_event(ev, sequence);
+    }
+  }
+
+  // Parse the next event of `input`, read from the terminal, into `ev` and
+  // the characters that produced it into `sequence`, removing them from
+  // `input`. Returns false once `input` is exhausted without completing an
+  // event. This is the step every front end reading events one by one goes
+  // through.
+  bool next_event(Parser &parser, std::span<const char> &input, event &ev,
+                  std::string_view &sequence) {
+    while (!input.empty()) {
+      if (take_held_event(parser, input, ev) ||
+          parse_input(parser, input, {&ev, 1}) != 0) {
+        sequence = parser.last_sequence();
+        // Only keys read in one piece, the parser may need its copy of the
+        // others to carry the next sequence
+        if (collapse_key_repeats_ && ev.is_key_event() &&
+            ev.special_kind() == event::special_kinds::None &&
+            sequence.data() + sequence.size() == input.data()) {
+          merge_key_repeats(parser, input, ev, sequence);
+        }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Parse the next events of `input`, read from the terminal, into `events`
+  // after the `count` already there, and return the new count. The
+  // characters parsed are removed from `input`. Mouse motions and key
+  // repeats are merged with the events already there as enabled. This is the
+  // step of the front ends reading events in batches, it stops after a paste
+  // event so that pasted_text() is its text.
+  size_t next_events(Parser &parser, std::span<const char> &input,
+                     std::span<event> events, size_t count) {
+    const size_t unchanged = count == 0 ? 0 : count - 1; // The last run may
+                                                          // go on
+    if (count < events.size() &&
+        take_held_event(parser, input, events[count])) {
+      ++count;
+    }
+    count += parse_input(parser, input, events.subspan(count));
+    if (coalesce_mouse_motion_) {
+      count = unchanged + ::dpsg::coalesce_mouse_motion(
+                              events.first(count).subspan(unchanged));
+    }
+    if (collapse_key_repeats_) {
+      count = unchanged + ::dpsg::collapse_key_repeats(
+                              events.first(count).subspan(unchanged));
+    }
+    return count;
+  }
+
+  term_position cursor_position_{0xFFFF, 0xFFFF};
+
+protected:
+  explicit terminal_base(int output_fd) noexcept : output_fd_{output_fd} {}
+
+  int output_fd_; // Where queries and mode changes are written
+  std::string_view pasted_text_;
+  std::deque<std::promise<term_position>> cursor_queries_;
+  bool coalesce_mouse_motion_ = false;
+  bool collapse_key_repeats_ = false;
+  input_recorder *recorder_ = nullptr;
+  // The event merge_key_repeats() parsed past the copies, and the number of
+  // characters of the input it took
+  std::optional<std::pair<event, size_t>> held_;
+
+  void record(std::span<const char> input) {
+    if (recorder_ != nullptr) {
+      recorder_->record(input);
+    }
+  }
+
+  void answer_cursor_query(term_position position) {
+    if (!cursor_queries_.empty()) {
+      cursor_queries_.front().set_value(position);
+      cursor_queries_.pop_front();
+    }
+  }
+
+  // Parse the start of `input` into `out` and remove what was parsed from
+  // it, keeping track of the cursor, pastes and queries. The parser stops
+  // after a paste or a cursor report, only the last event needs a look.
+  size_t parse_input(Parser &parser, std::span<const char> &input,
+                     std::span<event> out) {
+    parser.expect_cursor_report(!cursor_queries_.empty());
+    auto [consumed, written] = parser.parse(input, out);
+    input = input.subspan(consumed);
+    cursor_position_ = parser.cursor_position();
+    if (written != 0) {
+      track(parser, out[written - 1]);
+    }
+    return written;
+  }
+
+  void track(const Parser &parser, event last) {
+    if (last.is_paste_event()) {
+      pasted_text_ = parser.last_sequence();
+    } else if (last.is_cursor_report_event()) {
+      answer_cursor_query(cursor_position_);
+    }
+  }
+
+  // Give the event held by merge_key_repeats() as if it were parsed now.
+  // The parser hasn't moved since, so it still describes that event.
+  bool take_held_event(const Parser &parser, std::span<const char> &input,
+                       event &ev) {
+    if (!held_.has_value()) {
+      return false;
+    }
+    ev = held_->first;
+    input = input.subspan(held_->second);
+    held_.reset();
+    cursor_position_ = parser.cursor_position();
+    track(parser, ev);
+    return true;
+  }
+
+  // Parse the events following the key event `ev` at the start of `input`
+  // and merge the copies of it into it, as ::dpsg::collapse_key_repeats()
+  // does, extending `sequence` over them. The first event that isn't a copy
+  // is held, its characters left in `input`, and given by the next call:
+  // parsing it changed the state of the parser (a paste may have started),
+  // so it can't be parsed again.
+  void merge_key_repeats(Parser &parser, std::span<const char> &input,
+                         event &ev, std::string_view &sequence) {
+    while (!input.empty()) {
+      event next;
+      parser.expect_cursor_report(!cursor_queries_.empty());
+      auto [consumed, written] = parser.parse(input, {&next, 1});
+      if (written != 0 && !detail::merge_key_repeat(ev, next)) {
+        held_.emplace(next, consumed);
+        return;
+      }
+      // Either a copy, or the rest of the input was kept by the parser
+      input = input.subspan(consumed);
+      if (written != 0) {
+        sequence = {sequence.data(), sequence.size() + consumed};
+      }
+    }
+  }
+};
+} // namespace detail
+
+// Puts the terminal of the process, its standard input and output, in raw
+// mode and restores it on destruction or on fatal signals. The original
+// settings, the resize pipe and the signal handlers are process wide, so only
+// one context may exist at a time. terminal_session handles any other
+// terminal.
+//
+// Parser is the backend used to parse the input of the streams, either
+// input_parser or table_input_parser. Latency is either no_input_latency or
+// input_latency to time the streams, see latency().
+template <int Mode, class Parser = input_parser,
+          class Latency = no_input_latency>
+struct raw_mode_context_basic : detail::terminal_base<Parser> {
+private:
+  using base = detail::terminal_base<Parser>;
+  using base::record;
+
+public:
+  using base::cursor_position_;
+  using base::next_event;
+  using base::next_events;
+
+  raw_mode_context_basic() noexcept : base{STDOUT_FILENO} {
+    assert(!detail::raw_mode_active &&
+           "Only one raw_mode_context_basic may exist at a time");
+    detail::raw_mode_active = true;
+    raw_mode_enable(&detail::orig_termios, Mode);
+    if (pipe2(detail::resize_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+      detail::resize_pipe[0] = detail::resize_pipe[1] = -1;
+    }
+    detail::update_terminal_size();
+    register_signal_handlers();
+  }
+
+private:
+  static void set_handler(int signal, void (*func)(int), size_t index) {
+    memset(&detail::new_sa[index], 0, sizeof(detail::new_sa[index]));
+    detail::new_sa[index].sa_handler = func;
+    sigaction(signal, &detail::new_sa[index], &detail::old_sa[index]);
+  }
+
+  static void restore_old_and_raise(int sig, size_t idx) {
+    sigaction(sig, &detail::old_sa[idx], nullptr);
+    raise(sig);
+  }
+
+  void register_signal_handlers() {
+    for (int signal : detail::HANDLED_SIGNALS) {
+      set_handler(signal, &raw_mode_context_basic::handle_fatal_signal,
+                  detail::index_of(signal));
+    }
+    set_handler(SIGTSTP, &raw_mode_context_basic::handle_sigtstp,
+                detail::INDEX_HANDLER_SIGTSTP);
+    set_handler(SIGWINCH, &raw_mode_context_basic::handle_sigwinch,
+                detail::INDEX_HANDLER_SIGWINCH);
+  }
+
+  static void handle_sigwinch(int /*sig*/) { detail::notify_resize(); }
+
+  // Called on interuption from the outside (Ctrl-Z)
+  static void handle_sigtstp(int sig) {
+    set_handler(SIGCONT, &raw_mode_context_basic::handle_sigcont,
+                detail::INDEX_HANDLER_SIGCONT);
+    raw_mode_disable(&detail::orig_termios);
+    if (detail::require_mouse) {
+      ::dpsg::disable_mouse_tracking();
+    }
+    if (detail::require_bracketed_paste) {
+      ::dpsg::disable_bracketed_paste();
+    }
+    if (detail::kitty_keyboard_flags != 0) {
+      ::dpsg::disable_kitty_keyboard();
+    }
+    restore_old_and_raise(sig, detail::INDEX_HANDLER_SIGCONT);
+  }
+
+  // Called on continue from the outside (fg/bg)
+  static void handle_sigcont(int sig) {
+    set_handler(SIGTSTP, &raw_mode_context_basic::handle_sigtstp,
+                detail::INDEX_HANDLER_SIGTSTP);
+    raw_mode_enable(&detail::orig_termios, Mode);
+    if (detail::require_mouse) {
+      ::dpsg::enable_mouse_tracking();
+    }
+    if (detail::require_bracketed_paste) {
+      ::dpsg::enable_bracketed_paste();
+    }
+    if (detail::kitty_keyboard_flags != 0) {
+      ::dpsg::enable_kitty_keyboard(detail::kitty_keyboard_flags);
+    }
+    detail::notify_resize(); // We may have been resized while stopped
+    restore_old_and_raise(sig, detail::INDEX_HANDLER_SIGTSTP);
+  }
+
+  static void handle_fatal_signal(int sig) {
+    raw_mode_disable(&detail::orig_termios);
+    if (detail::require_mouse) {
+      ::dpsg::disable_mouse_tracking();
+    }
+    if (detail::require_bracketed_paste) {
+      ::dpsg::disable_bracketed_paste();
+    }
+    if (detail::kitty_keyboard_flags != 0) {
+      ::dpsg::disable_kitty_keyboard();
+    }
+
+    restore_old_and_raise(sig, detail::index_of(sig));
+  }
+
+public:
+  raw_mode_context_basic(const raw_mode_context_basic &) = delete;
+  raw_mode_context_basic &operator=(const raw_mode_context_basic &) = delete;
+  raw_mode_context_basic(raw_mode_context_basic &&) = delete;
+  raw_mode_context_basic &operator=(raw_mode_context_basic &&) = delete;
+
+  ~raw_mode_context_basic() noexcept {
+    raw_mode_disable(&detail::orig_termios);
+    // The next context would take our handlers for the original ones
+    for (int signal : detail::HANDLED_SIGNALS) {
+      sigaction(signal, &detail::old_sa[detail::index_of(signal)], nullptr);
+    }
+    sigaction(SIGTSTP, &detail::old_sa[detail::INDEX_HANDLER_SIGTSTP],
+              nullptr);
+    sigaction(SIGWINCH, &detail::old_sa[detail::INDEX_HANDLER_SIGWINCH],
+              nullptr);
+    for (int &fd : detail::resize_pipe) {
+      if (fd != -1) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    detail::raw_mode_active = false;
+  }
+
+  // Where the events are read from
+  [[nodiscard]] int input_fd() const noexcept {
+    (void)this; // This is intentionally not static
+    return STDIN_FILENO;
+  }
+
+  // Readable once the terminal is resized, until acknowledge_resize() is
+  // called. -1 if resizes can't be waited on. This is for event loops that
+  // wait on the terminal themselves, the streams report resize events.
+  [[nodiscard]] int resize_fd() const noexcept {
+    (void)this; // This is intentionally not static
+    return detail::resize_pipe[0];
+  }
+
+  // The resize reported by resize_fd() was handled. The new size goes to
+  // the recording, if any.
+  void acknowledge_resize() {
+    char drain[16];
+    while (read(resize_fd(), drain, sizeof(drain)) > 0) {
+    }
+    if (this->recorder_ != nullptr) {
+      const auto size = terminal_size();
+      this->recorder_->record_resize(static_cast<u16>(size.col),
+                                     static_cast<u16>(size.row));
+    }
+  }
+
+  // Size of the terminal, kept up to date on SIGWINCH. Unlike
+  // get_terminal_size(), this never makes a system call.
+  [[nodiscard]] struct terminal_size terminal_size() const noexcept {
+    (void)this; // This is intentionally not static
+    const u32 size =
+        detail::cached_terminal_size.load(std::memory_order_relaxed);
+    return {static_cast<int>(size >> 16), static_cast<int>(size & 0xFFFF)};
+  }
+
+  // Timings of the streams, empty unless Latency is input_latency
+  [[nodiscard]] Latency &latency() noexcept { return latency_; }
+  [[nodiscard]] const Latency &latency() const noexcept { return latency_; }
+
+  struct enable_mouse_t {
+    enable_mouse_t() noexcept {
+      ::dpsg::enable_mouse_tracking();
+      detail::require_mouse = true;
+    }
+    ~enable_mouse_t() noexcept {
+      ::dpsg::disable_mouse_tracking();
+      detail::require_mouse = false;
+    }
+    enable_mouse_t(const enable_mouse_t &) noexcept = delete;
+    enable_mouse_t(enable_mouse_t &&) noexcept = delete;
+    const enable_mouse_t &operator=(const enable_mouse_t &) noexcept = delete;
+    const enable_mouse_t &operator=(enable_mouse_t &&) noexcept = delete;
+  };
+
+  [[nodiscard]] enable_mouse_t enable_mouse_tracking() { return {}; }
+
+  struct enable_bracketed_paste_t {
+    enable_bracketed_paste_t() noexcept {
+      ::dpsg::enable_bracketed_paste();
+      detail::require_bracketed_paste = true;
+    }
+    ~enable_bracketed_paste_t() noexcept {
+      ::dpsg::disable_bracketed_paste();
+      detail::require_bracketed_paste = false;
+    }
+    enable_bracketed_paste_t(const enable_bracketed_paste_t &) noexcept =
+        delete;
+    enable_bracketed_paste_t(enable_bracketed_paste_t &&) noexcept = delete;
+    const enable_bracketed_paste_t &
+    operator=(const enable_bracketed_paste_t &) noexcept = delete;
+    const enable_bracketed_paste_t &
+    operator=(enable_bracketed_paste_t &&) noexcept = delete;
+  };
+
+  // While enabled, pasted text is delivered as a paste event instead of one
+  // key event per character, or as several if it spans reads
+  [[nodiscard]] enable_bracketed_paste_t enable_bracketed_paste() {
+    return {};
+  }
+
+  struct enable_kitty_keyboard_t {
+    explicit enable_kitty_keyboard_t(u8 flags) noexcept {
+      ::dpsg::enable_kitty_keyboard(flags);
+      detail::kitty_keyboard_flags = flags;
+    }
+    ~enable_kitty_keyboard_t() noexcept {
+      ::dpsg::disable_kitty_keyboard();
+      detail::kitty_keyboard_flags = 0;
+    }
+    enable_kitty_keyboard_t(const enable_kitty_keyboard_t &) noexcept =
+        delete;
+    enable_kitty_keyboard_t(enable_kitty_keyboard_t &&) noexcept = delete;
+    const enable_kitty_keyboard_t &
+    operator=(const enable_kitty_keyboard_t &) noexcept = delete;
+    const enable_kitty_keyboard_t &
+    operator=(enable_kitty_keyboard_t &&) noexcept = delete;
+  };
+
+  // While enabled, keys are reported with the kitty keyboard protocol, see
+  // the kitty_keyboard flags. With kitty_keyboard::report_event_types,
+  // releases and repeats are reported too, see held_keys.
+  [[nodiscard]] enable_kitty_keyboard_t
+  enable_kitty_keyboard(u8 flags = kitty_keyboard::disambiguate |
+                                   kitty_keyboard::report_event_types) {
+    return enable_kitty_keyboard_t{flags};
+  }
+
+  // Blocks until the terminal answers, and discards whatever was typed in
+  // the meantime. See request_cursor_position() for the asynchronous version.
+  [[nodiscard]] struct term_position cursor_position() const {
+    (void)this; // This is intentionally not static
+    constexpr static term_position invalid_pos = {(u16)0xFFFF, (u16)0xFFFF};
+    struct term_position p = {.col = 0, .row = 0};
+    char buf[32];
+    ssize_t i = 0; // Number of known characters in the buffer
+    query_cursor_position();
+
+    enum class state : char {
+      start,
+      esc,
+      bracket,
+      semicolon,
+      end
+    } state = state::start;
+    for (;;) {
+      const auto e = read(STDIN_FILENO, buf + i, sizeof(buf) - i);
+      if (e < 0) {
+        // There was an error
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          // But we can recover
+          continue;
+        } // We can't recover, return an invalid position
+        p = invalid_pos;
+        goto abort;
+
+      } else if (e == 0) [[unlikely]] {
+        // Not enough characters to form a valid response
+        p = invalid_pos;
+        goto abort;
+      } else [[likely]] {
+        // We need to extract the response from the buffer
+        // The response is of the form \033[<row>;<col>R
+        char *const end = buf + i + e;
+        char *begin = buf + i;
+        if (state == state::start) [[likely]] {
+          begin = std::find(begin, end, '\033');
+          if (begin == end) {
+            // No response yet
+            continue;
+          }
+          state = state::esc;
+          if (++begin == end) [[unlikely]] {
+            continue;
+          }
+        }
+
+        // consume the bracket, if not present, return an invalid position
+        if (state == state::esc) [[likely]] {
+          if (*begin != '[') [[unlikely]] {
+            // Not a valid response
+            p = invalid_pos;
             goto abort;
           }
           state = state::bracket;
@@ -735,7 +2888,6 @@ public:
 
   template <size_t BufSize = 32, int Timeout = -1>
   ::dpsg::generator<char> input_stream() {
-    (void)this;
     pollfd fds;
     fds.fd = STDIN_FILENO;
     fds.events = POLLIN;
@@ -760,6 +2912,9 @@ public:
       if (last == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         continue;
       }
+      if (last > 0) {
+        record({buffer, static_cast<size_t>(last)});
+      }
 
       current = 0;
       while (current < last) {
@@ -773,467 +2928,378 @@ public:
 
   void prompt_cursor_position() {}
 
+  void query_cursor_position() const {
+    (void)this;
+    ::dpsg::query_cursor_position();
+  }
+
 private:
-  constexpr static inline u8 UPPER_BOUND_CTRL_CHARACTERS =
-      32; // 32 first values represent ctrl+<char>. 0 is ctrl+` for some reason
+  [[no_unique_address]] Latency latency_;
+
+  // Wait for input on stdin and read it into the buffer. Returns the number
+  // of characters read, 0 if nothing was available before the timeout.
+  // `resized` is set when the terminal was resized in the meantime.
+  int poll_and_read(char *buffer, size_t size, int timeout, bool &resized) {
+    pollfd fds[2];
+    fds[0].fd = input_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = resize_fd(); // Ignored by poll() if -1
+    fds[1].events = POLLIN;
+
+    auto poll_result = poll(fds, 2, timeout);
+    if (poll_result == -1) {
+      if (errno == EINTR) {
+        return 0;
+      }
+      throw errno_exception{};
+    }
 
-  // Return the expected amount of unicode continuation characters
-  static size_t from_character(char c, event::key::modifiers mod, event &out) {
-    // CTRL+<char> is sent as (<char> - 'A' + 1). For some reason, '`' is sent
-    // as 0.
-    if ((((u32)c >> 6) & 0b11) == 0b11) { // unicode continuation
-      out = event{event::key{(char)c, mod}};
-      return out.get_key().code_point_count() - 1;
+    if (fds[1].revents != 0) {
+      acknowledge_resize();
+      resized = true;
     }
-    if (c < UPPER_BOUND_CTRL_CHARACTERS) {
-      out = event{event::key{(char)(c == 0 ? '`' : c + 'a' - 1),
-                             mod | event::key::modifiers::Ctrl}};
+
+    if (fds[0].revents == 0) {
       return 0;
     }
 
-    out = event{event::key{(char)c, mod}};
-    return 0;
-  };
-
-  static void parse_mouse(const u16 *numbers, event::mouse::modifiers mods,
-                          event &ev) {
-    auto magic = (event::mouse::modifiers)numbers[0];
-    auto x = numbers[1];
-    auto y = numbers[2];
-    ev = event::mouse{mods | magic, {.x = x, .y = y}};
-  }
-
-  static event parse_function_key(char c, event base, u16 modifiers) {
-    base.get_key().code = c;
-    switch ((event::key::funckey_modifiers)modifiers) {
-    case event::key::funckey_modifiers::Alt:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Alt;
-      break;
-    case event::key::funckey_modifiers::Shift:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Shift;
-      break;
-    case event::key::funckey_modifiers::Shift_Alt:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Shift;
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Alt;
-      break;
-    case event::key::funckey_modifiers::Control:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Ctrl;
-      break;
-    case event::key::funckey_modifiers::Shift_Control:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Shift;
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Ctrl;
-      break;
-    case event::key::funckey_modifiers::Alt_Control:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Alt;
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Ctrl;
-      break;
-    case event::key::funckey_modifiers::Shift_Alt_Control:
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Alt;
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Ctrl;
-      base.get_key().mods = base.get_key().mods | event::key::modifiers::Shift;
-      break;
+    auto last = read(input_fd(), buffer, size);
+    if (last == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      }
+      throw errno_exception{};
     }
-    return base;
+    return static_cast<int>(last);
   }
 
 public:
-  void query_cursor_position() const {
-    (void)this;
-    ::dpsg::query_cursor_position();
+  // Events are yielded along with the content of the whole read buffer they
+  // were parsed from.
+  //
+  // Alt keys are sent as ^[<char>, which is indistinguishable from an Esc
+  // followed by a regular character. When a read ends in the middle of a
+  // sequence, the stream waits EscapeTimeout milliseconds for the rest of it
+  // before resolving a lone ^[ into Esc (or ^[[ into Alt+[).
+  //
+  // Resizes of the terminal are reported as soon as they happen with a
+  // resize event and an empty payload, see terminal_size().
+  template <size_t BufSize = 32, int Timeout = 0,
+            int EscapeTimeout = default_escape_timeout>
+  ::dpsg::generator<std::pair<event, std::string>> event_stream() {
+    Parser parser;
+    detail::escape_timer escape;
+    char buffer[BufSize];
+    int last = 0;
+    event ev;
+
+    for (;;) { // BEGIN LOOP_OVER_POLL
+      bool resized = false;
+      int size = poll_and_read(buffer, sizeof(buffer),
+                               escape.poll_timeout(Timeout), resized);
+      if (resized) {
+        co_yield std::pair<event, std::string>{event::resize{}, std::string{}};
+      }
+      if (size == 0) {
+        if (escape.expired()) {
+          escape.disarm();
+          if (parser.flush({&ev, 1}) != 0) {
+            latency_.on_yield();
+            co_yield std::pair<event, std::string>{
+                ev, std::string{buffer, buffer + last}};
+            latency_.on_resume();
+          }
+        }
+        continue;
+      }
+      last = size;
+      latency_.on_read();
+      record({buffer, static_cast<size_t>(last)});
+
+      std::span<const char> input{buffer, static_cast<size_t>(last)};
+      std::string_view sequence;
+      while (next_event(parser, input, ev, sequence)) {
+        latency_.on_yield();
+        co_yield std::pair<event, std::string>{
+            ev, std::string{buffer, buffer + last}};
+        latency_.on_resume();
+      }
+      escape.update(parser, EscapeTimeout);
+    } // END LOOP_OVER_POLL
+
+    throw errno_exception{};
   }
 
-  term_position cursor_position_{0xFFFF, 0xFFFF};
+  // Same as event_stream(), but the payload is a view of the characters that
+  // produced the event, pointing into the internal buffers of the stream. It
+  // is only valid until the stream is resumed. Apart from the coroutine frame
+  // allocated on creation, this never allocates.
+  // batched_event_stream() is the payload-less alternative.
+  template <size_t BufSize = 32, int Timeout = 0,
+            int EscapeTimeout = default_escape_timeout>
+  ::dpsg::generator<std::pair<event, std::string_view>> event_view_stream() {
+    Parser parser;
+    detail::escape_timer escape;
+    char buffer[BufSize];
+    event ev;
 
-  template <size_t BufSize = 32, int Timeout = 0>
-  ::dpsg::generator<std::pair<event, std::string>> event_stream() {
-    (void)this;
-    pollfd fds;
-    fds.fd = STDIN_FILENO;
-    fds.events = POLLIN;
+    for (;;) { // BEGIN LOOP_OVER_POLL
+      bool resized = false;
+      int last = poll_and_read(buffer, sizeof(buffer),
+                               escape.poll_timeout(Timeout), resized);
+      if (resized) {
+        co_yield std::pair<event, std::string_view>{event::resize{},
+                                                    std::string_view{}};
+      }
+      if (last == 0) {
+        if (escape.expired()) {
+          escape.disarm();
+          if (parser.flush({&ev, 1}) != 0) {
+            latency_.on_yield();
+            co_yield std::pair<event, std::string_view>{
+                ev, parser.last_sequence()};
+            latency_.on_resume();
+          }
+        }
+        continue;
+      }
+      latency_.on_read();
+      record({buffer, static_cast<size_t>(last)});
+
+      std::span<const char> input{buffer, static_cast<size_t>(last)};
+      std::string_view sequence;
+      while (next_event(parser, input, ev, sequence)) {
+        latency_.on_yield();
+        co_yield std::pair<event, std::string_view>{ev, sequence};
+        latency_.on_resume();
+      }
+      escape.update(parser, EscapeTimeout);
+    } // END LOOP_OVER_POLL
 
-    enum class parse_state {
-      expecting_first,
-      expecting_control_character,
-      expecting_control_sequence,
-      parsing_number,
-      expecting_unicode,
-      expecting_sun_function_key,
-    };
+    throw errno_exception{};
+  }
 
-    int first_buffer_char = 0;
-    u8 expected_code_points = 0;
-    u8 current_code_point = 0;
-    event result;
+  // Same as event_stream(), but every read is parsed in one go into the
+  // caller provided `events` and yielded as a single span, instead of
+  // resuming the coroutine for every event. A read of BufSize characters
+  // never produces more than BufSize events, so an `events` span at least
+  // that large is yielded exactly once per read. Smaller spans are yielded
+  // as many times as necessary, and a batch always ends after a paste event,
+  // the text of which is available through pasted_text().
+  // See coalesce_mouse_motion(bool) and collapse_key_repeats(bool) to get rid
+  // of redundant events.
+  // The yielded span aliases `events` and is overwritten on resumption.
+  template <size_t BufSize = 4096, int Timeout = 0,
+            int EscapeTimeout = default_escape_timeout>
+  ::dpsg::generator<std::span<event>>
+  batched_event_stream(std::span<event> events) {
+    assert(!events.empty() && "batched_event_stream requires some storage");
+    Parser parser;
+    detail::escape_timer escape;
+    char buffer[BufSize];
 
     for (;;) { // BEGIN LOOP_OVER_POLL
-      auto poll_result = poll(&fds, 1, Timeout);
-      if (poll_result == -1) {
-        if (errno == EINTR) {
+      bool resized = false;
+      int last = poll_and_read(buffer, sizeof(buffer),
+                               escape.poll_timeout(Timeout), resized);
+      if (resized) {
+        events[0] = event::resize{};
+        co_yield events.first(1);
+      }
+      if (last == 0) {
+        if (escape.expired()) {
+          escape.disarm();
+          if (parser.flush(events) != 0) {
+            latency_.on_yield();
+            co_yield events.first(1);
+            latency_.on_resume();
+          }
+        }
+        continue;
+      }
+      latency_.on_read();
+      record({buffer, static_cast<size_t>(last)});
+
+      std::span<const char> input{buffer, static_cast<size_t>(last)};
+      size_t count = 0;
+      for (;;) {
+        count = next_events(parser, input, events, count);
+        if (count != 0 && events[count - 1].is_paste_event()) {
+          // Its text is only valid until the next parse
+          latency_.on_yield();
+          co_yield events.first(count);
+          latency_.on_resume();
+          count = 0;
           continue;
         }
-        throw errno_exception{};
+        if (input.empty()) {
+          break;
+        }
+        if (count == events.size()) {
+          latency_.on_yield();
+          co_yield events; // Full, and there's more to come
+          latency_.on_resume();
+          count = 0;
+        }
       }
-
-      if (poll_result == 0) {
-        continue;
+      escape.update(parser, EscapeTimeout);
+      if (count != 0) {
+        latency_.on_yield();
+        co_yield events.first(count);
+        latency_.on_resume();
       }
+    } // END LOOP_OVER_POLL
 
-      int last = 0;
-      char buffer[BufSize];
-      last = read(STDIN_FILENO, buffer + first_buffer_char,
-                  sizeof(buffer) - first_buffer_char);
-      if (last == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        continue;
-      }
-      last += first_buffer_char;
-
-      parse_state state{parse_state::expecting_first}; // FSM state
-      int current = 0; // Index of the current character in the buffer
-      int start_of_new_sequence =
-          0; // Where is the start of the current control sequence
-      char control_character = 0; // What's the character right after ^[
-      u16 num_parameters[4] = {
-          0}; // Numeric parameters parsed from a control sequence
-      u16 *current_param =
-          num_parameters; // Pointer to the number being parsed. Keep it inside
-                          // num_parameters
-
-      const auto finalize_parse = [&] {
-        // Reset state for the next parse
-        state = parse_state::expecting_first;
-        do { // reset current_param and num_parameters to 0 (yes, it works)
-          *current_param = 0;
-        } while ((current_param != num_parameters) && (current_param--, true));
+    throw errno_exception{};
+  }
+};
 
-        start_of_new_sequence = current;
-        result = event{};
-        current_code_point = 0;
-        first_buffer_char = 0;
-      };
-      const auto yield = [&] {
-        auto r = result;
-        finalize_parse();
-        // return the result
-        return std::pair<event, std::string>{
-            r, std::string{buffer, buffer + last}};
-      };
+using raw_mode_context = raw_mode_context_basic<ISIG | ECHO | ICANON>;
+using cbreak_mode_context = raw_mode_context_basic<ECHO | ICANON>;
 
-      // BEGIN LOOP_OVER_BUFFER
-      while (current < last) {
-        char c = buffer[current++];
+// A terminal reached through its own file descriptors, e.g. one side of a
+// pty, instead of the standard input and output of the process. A session
+// keeps all of its state to itself and touches neither signal handlers nor
+// globals, so a process can host as many as it has file descriptors for.
+// The flip side is that nobody restores the terminal if the process is
+// killed, and that resizes are up to the owner to report.
+//
+// Sessions don't wait for input: the owner waits on input_fd(), usually
+// through reactor::add_session(), and calls read_events() when it's ready.
+template <class Parser = input_parser>
+class terminal_session : public detail::terminal_base<Parser> {
+  using base = detail::terminal_base<Parser>;
 
-        if (expected_code_points != 0) {
+public:
+  // The file descriptors stay owned by the caller. Mode is the set of local
+  // flags to clear (see raw_mode_context_basic), it is only applied if
+  // `input_fd` is a terminal.
+  terminal_session(int input_fd, int output_fd,
+                   int mode = ISIG | ECHO | ICANON) noexcept
+      : base{output_fd}, input_fd_{input_fd} {
+    if (tcgetattr(input_fd_, &orig_termios_) == 0) {
+      raw_mode_enable(&orig_termios_, mode, input_fd_);
+      raw_ = true;
+    }
+    update_terminal_size();
+  }
 
-          result.get_key().data[++current_code_point] = c;
-          expected_code_points--;
+  terminal_session(const terminal_session &) = delete;
+  terminal_session &operator=(const terminal_session &) = delete;
+  terminal_session(terminal_session &&) = delete;
+  terminal_session &operator=(terminal_session &&) = delete;
+
+  ~terminal_session() noexcept {
+    enable_kitty_keyboard(0);
+    enable_bracketed_paste(false);
+    enable_mouse_tracking(false);
+    if (raw_) {
+      raw_mode_disable(&orig_termios_, input_fd_);
+    }
+  }
 
-          if (expected_code_points == 0) {
-            result.get_key().mods =
-                result.get_key().mods | event::key::modifiers::Unicode;
-            co_yield yield();
-          }
+  [[nodiscard]] int input_fd() const noexcept { return input_fd_; }
+  [[nodiscard]] int output_fd() const noexcept { return this->output_fd_; }
 
-          continue;
-        }
+  void enable_mouse_tracking(bool enable) {
+    if (enable != mouse_) {
+      enable ? ::dpsg::enable_mouse_tracking(this->output_fd_)
+             : ::dpsg::disable_mouse_tracking(this->output_fd_);
+      mouse_ = enable;
+    }
+  }
 
-        switch (state) {
-
-        case parse_state::expecting_first: {
-          if (c == '\033') {
-            // Control character, expect this to be a control sequence
-            // If it isn't (ESC or Alt char), the buffer will end there, and
-            // we'll deal with the event at the end of the loop
-            state = parse_state::expecting_control_character;
-          } else {
-            expected_code_points =
-                from_character(c, event::key::modifiers::None, result);
-            if (expected_code_points == 0) {
-              co_yield yield();
-            }
-          }
-          break;
-        } // parse_state::expecting_first:
+  void enable_bracketed_paste(bool enable) {
+    if (enable != bracketed_paste_) {
+      enable ? ::dpsg::enable_bracketed_paste(this->output_fd_)
+             : ::dpsg::disable_bracketed_paste(this->output_fd_);
+      bracketed_paste_ = enable;
+    }
+  }
 
-        case parse_state::expecting_control_character: {
-          switch (c) {
-          case '[': { // Control !
-            state = parse_state::expecting_control_sequence;
-            control_character = c;
-            break;
-          }
-          case 'O': {
-            state = parse_state::expecting_sun_function_key;
-            break;
-          }
-          default: {
-            expected_code_points =
-                from_character(c, event::key::modifiers::Alt, result);
-            if (expected_code_points == 0) {
-              co_yield yield();
-            }
-          }
-          }
-          break;
-        } // parse_state::expecting_control_character
-
-        case parse_state::expecting_control_sequence: {
-          if (isdigit(c)) {
-            state = parse_state::parsing_number;
-            *current_param = c - '0';
-          } else {
-            switch (c) {
-            case '<': { // mouse sequence
-              state = parse_state::parsing_number;
-              break;
-            }
-            case 'A': {
-              result = term_events::arrow_up;
-              co_yield yield();
-              break;
-            }
-            case 'B': {
-              result = term_events::arrow_down;
-              co_yield yield();
-              break;
-            }
-            case 'C': {
-              result = term_events::arrow_right;
-              co_yield yield();
-              break;
-            }
-            case 'D': {
-              result = term_events::arrow_left;
-              co_yield yield();
-              break;
-            }
-            default: {
-              throw invalid_sequence_start(buffer, last, c);
-            }
-            }
-          }
-          break;
-        } // case parse_state::expecting_control_sequence
-
-        case parse_state::parsing_number: {
-          if (isdigit(c)) {
-            *current_param = (*current_param * 10) + (c - '0');
-          } else {
-            switch (c) {
-            case ';': {
-              current_param++;
-              assert(current_param < num_parameters + 4 &&
-                     "More than 4 numeric characters in terminal control "
-                     "sequence!");
-              break;
-            }
-            case 'm': {
-              assert(current_param == num_parameters + 2 &&
-                     "Mouse events require exactly 3 values");
-              parse_mouse(num_parameters, event::mouse::modifiers::Release,
-                          result);
-              co_yield yield();
-              break;
-            }
-            case 'M': {
-              assert(current_param == num_parameters + 2 &&
-                     "Mouse events require exactly 3 values");
-              parse_mouse(num_parameters, event::mouse::modifiers::None,
-                          result);
-              co_yield yield();
-              break;
-            }
-            case 'A': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for arrow key!");
-              result = parse_function_key(c, term_events::arrow_up,
-                                          num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'B': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for arrow key!");
-              result = parse_function_key(c, term_events::arrow_down,
-                                          num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'C': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for arrow key!");
-              result = parse_function_key(c, term_events::arrow_right,
-                                          num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'D': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for arrow key!");
-              result = parse_function_key(c, term_events::arrow_left,
-                                          num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'P': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for function key!");
-              result =
-                  parse_function_key(c, term_events::f1, num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'Q': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for function key!");
-              result =
-                  parse_function_key(c, term_events::f2, num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case 'R': {
-              if (current_param == num_parameters + 1) {
-                assert(num_parameters[0] == 1 &&
-                       "Unknown sequence for function key!");
-                result =
-                    parse_function_key(c, term_events::f3, num_parameters[1]);
-                co_yield yield();
-              } else if (current_param ==
-                         num_parameters + 2) { // Cursor position
-                cursor_position_ = term_position{.x = num_parameters[1],
-                                                 .y = num_parameters[0]};
-                finalize_parse();
-              }
-              break;
-            }
-            case 'S': {
-              assert(num_parameters[0] == 1 &&
-                     current_param == num_parameters + 1 &&
-                     "Unknown sequence for function key!");
-              result =
-                  parse_function_key(c, term_events::f4, num_parameters[1]);
-              co_yield yield();
-              break;
-            }
-            case '~': { // extension function key
-              assert(current_param <= num_parameters + 1 &&
-                     "Unknown numeric sequence for extended function key");
-
-              result = parse_function_key(
-                  (char)num_parameters[0],
-                  // This doesn't matter, the actual code is drawn from the
-                  // first parameter
-                  term_events::f4,
-                  // If we didn't get a modifier key, send 1 (no mod)
-                  (current_param == num_parameters + 1) ? num_parameters[1]
-
-                                                        : 1);
-              co_yield yield();
-              break;
-            }
-            default: {
-              throw unfinished_numeric_sequence(buffer, last, num_parameters,
-                                                current_param + 1, c);
-            }
-            } // switch(c)
-            break;
-          }
-          break;
-        } // case parse_state::parsing_number
-        case parse_state::expecting_sun_function_key: {
-          switch (c) {
-          case 'P':
-            result = term_events::f1;
-            co_yield yield();
-            break;
-          case 'Q':
-            result = term_events::f2;
-            co_yield yield();
-            break;
-          case 'R':
-            result = term_events::f3;
-            co_yield yield();
-            break;
-          case 'S':
-            result = term_events::f4;
-            co_yield yield();
-            break;
-          default:
-            throw invalid_function_key(buffer, last, c);
-          }
-          break;
-        } // case parse_state::expecting_sun_function_key
-
-        } // switch(state)
-
-      } // END LOOP_OVER_BUFFER
-
-      // Alt keys are sent as ^[<char>. If events come really fast, or
-      // accumulate in the buffer a long time, it may be difficult to
-      // differentiate between the start of a control sequence and a regular
-      // Alt/Esc char. Using a bigger buffer may help. In the absence of a
-      // better solution, we'll consider that an alt character cannot appear at
-      // the end of the buffer That's obviously not true, but should be enough
-      // for most cases
-      const auto copy_leftover_to_beginning = [&] {
-        // End of sequence is 1 behind beginning of new one
-        for (auto x = 0; x < (last - start_of_new_sequence + 1); ++x) {
-          buffer[x] = buffer[start_of_new_sequence + x];
-        }
-        first_buffer_char = last - start_of_new_sequence;
-      };
+  // Report keys with the kitty keyboard protocol using `flags`, see
+  // kitty_keyboard, or go back to the legacy encoding if 0
+  void enable_kitty_keyboard(u8 flags) {
+    if (flags != kitty_keyboard_flags_) {
+      if (kitty_keyboard_flags_ != 0) {
+        ::dpsg::disable_kitty_keyboard(this->output_fd_);
+      }
+      if (flags != 0) {
+        ::dpsg::enable_kitty_keyboard(flags, this->output_fd_);
+      }
+      kitty_keyboard_flags_ = flags;
+    }
+  }
 
-      switch (state) {
-      case parse_state::expecting_control_sequence: {
-        // This is a legitimate Alt char.
-        if (last != BufSize) {
-          from_character(control_character, event::key::modifiers::Alt, result);
-          co_yield yield();
-        } else {
-          // We have and unfinished sequence on our hands. We'll copy it at the
-          // beginning and tell read() to use a smaller buffer for the next pass
-          copy_leftover_to_beginning();
-        }
-        break;
-      } // case parse_state::expecting_control_character
+  // Size of the terminal as of the last call to update_terminal_size()
+  [[nodiscard]] struct terminal_size terminal_size() const noexcept {
+    return size_;
+  }
 
-      case parse_state::expecting_control_character: {
-        // Legitimate Esc
-        if (last != BufSize) {
-          result = event::key{'\033'};
-          co_yield yield();
-        }
-      } // case parse_state::expecting_control_character
+  // Ask the terminal for its size, to be called when it may have changed.
+  // The size is left alone if the output isn't a terminal.
+  struct terminal_size update_terminal_size() noexcept {
+    struct winsize w;
+    if (ioctl(this->output_fd_, TIOCGWINSZ, &w) == 0) {
+      size_ = {w.ws_col, w.ws_row};
+    }
+    return size_;
+  }
 
-      case parse_state::expecting_first: {
-        break; // We're not in the middle of a parse, nothing to do at this
-               // point.
-      }        // case parse_state::expecting_first
+  // Read what is available on input_fd() and call `on_event` with every
+  // event and the characters that produced it. The characters are only
+  // valid for the duration of the call. Returns the result of read(): 0 at
+  // the end of the input, -1 if nothing could be read.
+  template <class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  ssize_t read_events(F &&on_event) {
+    char buffer[4096];
+    const auto size = read(input_fd_, buffer, sizeof(buffer));
+    if (size > 0) {
+      this->process_input(
+          parser_, std::span<const char>{buffer, static_cast<size_t>(size)},
+          on_event);
+    }
+    return size;
+  }
 
-      default:
-        // We're in the middle of a parse, but the result is entirely determined
-        // by what follows
-        copy_leftover_to_beginning();
+  // Emit the event held back by the parser, a lone ^[ waiting to know if it
+  // starts a sequence. To be called once the escape timeout expired.
+  template <class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  void flush_events(F &&on_event) {
+    event ev;
+    if (parser_.flush({&ev, 1}) != 0) {
+      on_event(ev, parser_.last_sequence());
+    }
+  }
 
-      } // switch(state)
+  // Whether flush_events() has something to emit
+  [[nodiscard]] bool pending() const noexcept { return parser_.pending(); }
 
-    } // END LOOP_OVER_POLL
+  [[nodiscard]] Parser &parser() noexcept { return parser_; }
 
-    throw errno_exception{};
-  }
+private:
+  int input_fd_;
+  bool raw_ = false;
+  bool mouse_ = false;
+  bool bracketed_paste_ = false;
+  u8 kitty_keyboard_flags_ = 0;
+  struct terminal_size size_ {
+    -1, -1
+  };
+  struct termios orig_termios_ {};
+  Parser parser_;
 };
 
-using raw_mode_context = raw_mode_context_basic<ISIG | ECHO | ICANON>;
-using cbreak_mode_context = raw_mode_context_basic<ECHO | ICANON>;
-
 #ifdef DPSG_COMPILE_LINUX_TERM
 struct termios detail::orig_termios {};
 bool detail::require_mouse{};
+bool detail::require_bracketed_paste{};
+u8 detail::kitty_keyboard_flags{};
+std::atomic<u32> detail::cached_terminal_size{};
+int detail::resize_pipe[2]{-1, -1};
+bool detail::raw_mode_active{};
 struct sigaction detail::new_sa[MAX_SIGNAL]{}, detail::old_sa[MAX_SIGNAL]{};
 #endif
 
@@ -0,0 +1,407 @@
+#pragma once
+
+#include "linux_term.hpp"
+#include "types.hpp"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+}
+
+namespace dpsg {
+
+// Single threaded event loop waiting on any number of file descriptors,
+// timers and signals at once. Every source is registered with epoll, so a
+// wakeup only costs as much as the number of sources that are ready.
+//
+// Handlers may add and remove sources, including themselves, while they are
+// being dispatched.
+class reactor {
+public:
+  // Identifies a registered source. Ids are never reused for another source.
+  struct source_id {
+    u32 index;
+    u32 generation;
+  };
+
+  reactor() : epoll_fd_{epoll_create1(EPOLL_CLOEXEC)} {
+    if (epoll_fd_ == -1) {
+      throw errno_exception{};
+    }
+  }
+
+  reactor(const reactor &) = delete;
+  reactor &operator=(const reactor &) = delete;
+  reactor(reactor &&) = delete;
+  reactor &operator=(reactor &&) = delete;
+
+  ~reactor() noexcept {
+    for (auto &source : sources_) {
+      if (source.alive && source.owns_fd) {
+        close(source.fd);
+      }
+    }
+    close(epoll_fd_);
+  }
+
+  // Call `on_ready` with the epoll events (EPOLLIN, EPOLLOUT...) of `fd`
+  // every time it is ready for one of `events`. The caller keeps ownership
+  // of `fd`, and must remove it before closing it.
+  template <class F>
+    requires std::is_invocable_v<F &, u32>
+  source_id watch(int fd, u32 events, F &&on_ready) {
+    return add(fd, false, events, std::forward<F>(on_ready));
+  }
+
+  // Call `on_expired` with the number of expirations after `delay`, then
+  // every `interval` if it isn't zero.
+  template <class F>
+    requires std::is_invocable_v<F &, u64>
+  source_id add_timer(std::chrono::nanoseconds delay,
+                      std::chrono::nanoseconds interval, F &&on_expired) {
+    const int fd = create_timer();
+    // A zero delay would disarm the timer
+    arm_timer(fd, std::max(delay, std::chrono::nanoseconds{1}), interval);
+    return add_timer(fd, std::forward<F>(on_expired));
+  }
+
+  // Call `on_signal` every time `signal` is received. The signal is blocked
+  // in the calling thread for as long as the source exists, it must also be
+  // blocked in every other thread for the notification to be reliable.
+  // Don't use it for the signals handled by raw_mode_context_basic.
+  template <class F>
+    requires std::is_invocable_v<F &, const signalfd_siginfo &>
+  source_id add_signal(int signal, F &&on_signal) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signal);
+    if (const int error = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        error != 0) {
+      errno = error;
+      throw errno_exception{};
+    }
+    const int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+      throw errno_exception{};
+    }
+    auto id = add(fd, true, EPOLLIN,
+                  [fd, on_signal = std::forward<F>(on_signal)](
+                      u32 /*events*/) mutable {
+                    signalfd_siginfo info;
+                    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+                      on_signal(info);
+                    }
+                  });
+    sources_[id.index].signal = signal;
+    return id;
+  }
+
+  // Read the terminal of `context` and call `on_event` with every event and
+  // the characters that produced it, as event_view_stream() would. A lone
+  // ^[ is resolved after `escape_timeout` milliseconds, and resizes are
+  // reported as resize events. Removing the returned source stops all of it.
+  template <int Mode, class Parser, class Latency, class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  source_id
+  add_terminal(raw_mode_context_basic<Mode, Parser, Latency> &context,
+               F &&on_event, int escape_timeout = default_escape_timeout) {
+    struct terminal {
+      raw_mode_context_basic<Mode, Parser, Latency> &context;
+      std::decay_t<F> on_event;
+      source_id input{};
+      Parser parser{};
+      char buffer[4096];
+
+      int fd() const noexcept { return context.input_fd(); }
+      ssize_t read_events() {
+        const auto size = read(fd(), buffer, sizeof(buffer));
+        if (size > 0) {
+          context.process_input(
+              parser, std::span<const char>{buffer, static_cast<size_t>(size)},
+              on_event);
+        }
+        return size;
+      }
+      void flush_events() {
+        event ev;
+        if (parser.flush({&ev, 1}) != 0) {
+          on_event(ev, parser.last_sequence());
+        }
+      }
+      bool pending() const noexcept { return parser.pending(); }
+    };
+    auto state =
+        std::make_shared<terminal>(context, std::forward<F>(on_event));
+    const auto input = add_input(state, escape_timeout);
+
+    if (context.resize_fd() != -1) {
+      const auto resize =
+          watch(context.resize_fd(), EPOLLIN, [state](u32 /*events*/) {
+            state->context.acknowledge_resize();
+            state->on_event(event::resize{}, std::string_view{});
+          });
+      sources_[input.index].linked.push_back(resize);
+    }
+    return input;
+  }
+
+  // Read the input of `session` whenever it is ready and call `on_event`
+  // with every event and the characters that produced it. A lone ^[ is
+  // resolved after `escape_timeout` milliseconds. The session must outlive
+  // the returned source.
+  template <class Parser, class F>
+    requires std::is_invocable_v<F &, event, std::string_view>
+  source_id add_session(terminal_session<Parser> &session, F &&on_event,
+                        int escape_timeout = default_escape_timeout) {
+    struct session_state {
+      terminal_session<Parser> &session;
+      std::decay_t<F> on_event;
+      source_id input{};
+
+      int fd() const noexcept { return session.input_fd(); }
+      ssize_t read_events() { return session.read_events(on_event); }
+      void flush_events() { session.flush_events(on_event); }
+      bool pending() const noexcept { return session.pending(); }
+    };
+    return add_input(
+        std::make_shared<session_state>(session, std::forward<F>(on_event)),
+        escape_timeout);
+  }
+
+  // Stop watching a source, along with the sources created with it. File
+  // descriptors created by the reactor are closed.
+  void remove(source_id id) {
+    if (id.index >= sources_.size()) {
+      return;
+    }
+    auto &source = sources_[id.index];
+    if (!source.alive || source.generation != id.generation) {
+      return;
+    }
+    source.alive = false;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, source.fd, nullptr);
+    if (source.owns_fd) {
+      close(source.fd);
+    }
+    if (source.signal != 0) {
+      sigset_t mask;
+      sigemptyset(&mask);
+      sigaddset(&mask, source.signal);
+      pthread_sigmask(SIG_UNBLOCK, &mask, nullptr);
+      source.signal = 0;
+    }
+    // The handler may be running, it is destroyed once dispatch is over
+    removed_.push_back(id.index);
+    for (auto linked : std::exchange(source.linked, {})) {
+      remove(linked);
+    }
+    if (!dispatching_) {
+      collect();
+    }
+  }
+
+  // Wait up to `timeout` milliseconds (-1 for no limit) for sources to be
+  // ready and dispatch them. Returns the number of sources dispatched, 0 on
+  // timeout or if interrupted by a signal. An exception thrown by a handler,
+  // such as the read error of a terminal, stops the dispatch and is thrown
+  // from here, the sources not dispatched yet are still ready.
+  size_t run_once(int timeout = -1) {
+    const int ready =
+        epoll_wait(epoll_fd_, ready_, std::size(ready_), timeout);
+    if (ready == -1) {
+      if (errno == EINTR) {
+        return 0;
+      }
+      throw errno_exception{};
+    }
+
+    dispatching_ = true;
+    size_t dispatched = 0;
+    try {
+      for (int i = 0; i < ready; ++i) {
+        const auto index = static_cast<u32>(ready_[i].data.u64);
+        const auto generation = static_cast<u32>(ready_[i].data.u64 >> 32);
+        auto &source = sources_[index];
+        // Might have been removed by a previous handler
+        if (source.alive && source.generation == generation) {
+          source.handler(ready_[i].events);
+          ++dispatched;
+        }
+      }
+    } catch (...) {
+      dispatching_ = false;
+      collect();
+      throw;
+    }
+    dispatching_ = false;
+    collect();
+    return dispatched;
+  }
+
+  // Dispatch sources until stop() is called
+  void run() {
+    stopped_ = false;
+    while (!stopped_) {
+      run_once();
+    }
+  }
+
+  void stop() noexcept { stopped_ = true; }
+
+private:
+  struct source {
+    int fd = -1;
+    bool owns_fd = false;
+    bool alive = false;
+    int signal = 0; // Blocked while the source exists
+    u32 generation = 0;
+    std::function<void(u32)> handler;
+    std::vector<source_id> linked; // Removed along with this one
+  };
+
+  int epoll_fd_;
+  bool dispatching_ = false;
+  bool stopped_ = false;
+  std::deque<source> sources_; // Stable addresses, handlers can add sources
+  std::vector<u32> free_;
+  std::vector<u32> removed_;
+  epoll_event ready_[64];
+
+  template <class F>
+  source_id add(int fd, bool owns_fd, u32 events, F &&handler) {
+    u32 index;
+    if (free_.empty()) {
+      index = static_cast<u32>(sources_.size());
+      sources_.emplace_back();
+    } else {
+      index = free_.back();
+      free_.pop_back();
+    }
+    auto &source = sources_[index];
+    source.fd = fd;
+    source.owns_fd = owns_fd;
+    source.alive = true;
+    source.handler = std::forward<F>(handler);
+
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.u64 = (u64{source.generation} << 32) | index;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) == -1) {
+      const int error = errno;
+      source.alive = false;
+      source.handler = nullptr;
+      if (owns_fd) {
+        close(fd);
+      }
+      free_.push_back(index);
+      errno = error;
+      throw errno_exception{};
+    }
+    return {index, source.generation};
+  }
+
+  static int create_timer() {
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+      throw errno_exception{};
+    }
+    return fd;
+  }
+
+  // Call `on_expired` whenever the timer `fd`, owned by the reactor from now
+  // on, expires. It is left as it is, arm it with arm_timer().
+  template <class F> source_id add_timer(int fd, F &&on_expired) {
+    return add(fd, true, EPOLLIN,
+               [fd, on_expired = std::forward<F>(on_expired)](
+                   u32 /*events*/) mutable {
+                 u64 expirations = 0;
+                 if (read(fd, &expirations, sizeof(expirations)) ==
+                     sizeof(expirations)) {
+                   on_expired(expirations);
+                 }
+               });
+  }
+
+  // Watch the input of a terminal, with a timer resolving a lone ^[ after
+  // `escape_timeout` milliseconds linked to it. `state` provides fd(),
+  // read_events(), flush_events(), pending() and the `input` id. The source
+  // is removed at the end of the input, and when reading fails, the error is
+  // then thrown from run_once().
+  template <class State>
+  source_id add_input(std::shared_ptr<State> state, int escape_timeout) {
+    // Disarmed until a read leaves an unfinished sequence
+    const int escape_timer = create_timer();
+    const auto escape =
+        add_timer(escape_timer,
+                  [state](u64 /*expirations*/) { state->flush_events(); });
+    const std::chrono::nanoseconds timeout =
+        std::chrono::milliseconds{escape_timeout};
+
+    state->input = watch(
+        state->fd(), EPOLLIN,
+        [this, state, escape_timer, timeout](u32 /*events*/) {
+          ssize_t size;
+          do {
+            size = state->read_events();
+          } while (size < 0 && errno == EINTR);
+          if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // Someone else read it first
+          }
+          if (size <= 0) {
+            // End of input or error, it would be ready forever
+            const int error = errno;
+            remove(state->input);
+            if (size < 0) {
+              errno = error;
+              throw errno_exception{};
+            }
+            return;
+          }
+          // Resolve a pending ^[ if nothing comes in time. A zero delay
+          // disarms the timer, hence the extra nanosecond.
+          arm_timer(escape_timer,
+                    state->pending() ? timeout + std::chrono::nanoseconds{1}
+                                     : std::chrono::nanoseconds{0},
+                    std::chrono::nanoseconds{0});
+        });
+    sources_[state->input.index].linked.push_back(escape);
+    return state->input;
+  }
+
+  // Release the slots of the sources removed so far
+  void collect() {
+    for (auto index : removed_) {
+      auto &source = sources_[index];
+      source.handler = nullptr;
+      source.fd = -1;
+      source.generation++;
+      free_.push_back(index);
+    }
+    removed_.clear();
+  }
+
+  static void arm_timer(int fd, std::chrono::nanoseconds delay,
+                        std::chrono::nanoseconds interval) {
+    const auto to_timespec = [](std::chrono::nanoseconds duration) {
+      const auto seconds =
+          std::chrono::duration_cast<std::chrono::seconds>(duration);
+      return timespec{.tv_sec = static_cast<time_t>(seconds.count()),
+                      .tv_nsec = static_cast<long>((duration - seconds).count())};
+    };
+    const itimerspec spec{.it_interval = to_timespec(interval),
+                          .it_value = to_timespec(delay)};
+    if (timerfd_settime(fd, 0, &spec, nullptr) == -1) {
+      throw errno_exception{};
+    }
+  }
+};
+
+} // namespace dpsg
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <sys/ioctl.h>
+}
+
+namespace dpsg {
+
+// Recordings of terminal input, as read by the streams, to replay sessions
+// offline. The format is made of an 8 bytes header ("dpsgrec" and a version
+// byte) followed by one record per read or resize:
+//   - the time elapsed since the previous record (or since the recording
+//     started) in microseconds, as an LEB128 varint
+//   - the number of bytes read, as an LEB128 varint
+//   - the bytes, or for a resize, which reads nothing, the new number of
+//     columns and rows as LEB128 varints
+// Typing costs 3 bytes per key press. Version 1 has no resizes.
+namespace detail::recording {
+constexpr std::string_view magic = "dpsgrec\x02";
+constexpr std::string_view magic_v1 = "dpsgrec\x01";
+
+inline void put_varint(std::string &out, u64 value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline bool get_varint(std::string_view &in, u64 &value) {
+  value = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    if (in.empty()) {
+      return false;
+    }
+    const auto byte = static_cast<u8>(in.front());
+    in.remove_prefix(1);
+    value |= u64{byte & 0x7Fu} << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+} // namespace detail::recording
+
+// Appends what the streams read to a recording, see
+// raw_mode_context_basic::record_input(). Records are buffered, and written
+// out when the buffer fills up, on flush() and on destruction.
+class input_recorder {
+  using clock = std::chrono::steady_clock;
+
+public:
+  // `out` stays owned by the caller, and must outlive the recorder
+  explicit input_recorder(FILE *out)
+      : out_{out}, last_{clock::now()}, buffer_{detail::recording::magic} {}
+
+  input_recorder(const input_recorder &) = delete;
+  input_recorder &operator=(const input_recorder &) = delete;
+
+  ~input_recorder() noexcept { flush(); }
+
+  void record(std::span<const char> input) {
+    put_delay();
+    detail::recording::put_varint(buffer_, input.size());
+    buffer_.append(input.data(), input.size());
+    if (buffer_.size() >= flush_threshold) {
+      flush();
+    }
+  }
+
+  void record_resize(u16 columns, u16 rows) {
+    put_delay();
+    detail::recording::put_varint(buffer_, 0);
+    detail::recording::put_varint(buffer_, columns);
+    detail::recording::put_varint(buffer_, rows);
+  }
+
+  void flush() noexcept {
+    if (!buffer_.empty()) {
+      fwrite(buffer_.data(), 1, buffer_.size(), out_);
+      buffer_.clear();
+    }
+    fflush(out_);
+  }
+
+private:
+  static constexpr size_t flush_threshold = 64 * 1024;
+
+  FILE *out_;
+  clock::time_point last_;
+  std::string buffer_;
+
+  void put_delay() {
+    const auto now = clock::now();
+    const auto delay =
+        std::chrono::duration_cast<std::chrono::microseconds>(now - last_);
+    last_ = now;
+    detail::recording::put_varint(buffer_, static_cast<u64>(delay.count()));
+  }
+};
+
+struct input_record {
+  std::chrono::microseconds delay; // Since the previous record
+  std::string_view bytes;          // Empty for a resize
+  u16 columns = 0;                 // New size of a resize
+  u16 rows = 0;
+
+  [[nodiscard]] bool is_resize() const noexcept { return bytes.empty(); }
+};
+
+// A recording made by input_recorder, loaded in memory
+class input_recording {
+public:
+  // Read the whole of `in`. Throws std::runtime_error if it isn't a valid
+  // recording.
+  explicit input_recording(FILE *in) {
+    char chunk[4096];
+    size_t size = 0;
+    while ((size = fread(chunk, 1, sizeof(chunk), in)) != 0) {
+      data_.append(chunk, size);
+    }
+
+    std::string_view rest{data_};
+    if (!rest.starts_with(detail::recording::magic) &&
+        !rest.starts_with(detail::recording::magic_v1)) {
+      throw std::runtime_error("not an input recording");
+    }
+    rest.remove_prefix(detail::recording::magic.size());
+    while (!rest.empty()) {
+      u64 delay = 0;
+      u64 length = 0;
+      if (!detail::recording::get_varint(rest, delay) ||
+          !detail::recording::get_varint(rest, length) ||
+          length > rest.size()) {
+        throw std::runtime_error("truncated input recording");
+      }
+      input_record record{std::chrono::microseconds{delay},
+                          rest.substr(0, length)};
+      rest.remove_prefix(length);
+      if (length == 0) {
+        u64 columns = 0;
+        u64 rows = 0;
+        if (!detail::recording::get_varint(rest, columns) ||
+            !detail::recording::get_varint(rest, rows)) {
+          throw std::runtime_error("truncated input recording");
+        }
+        record.columns = static_cast<u16>(columns);
+        record.rows = static_cast<u16>(rows);
+      }
+      records_.push_back(record);
+    }
+  }
+
+  // The records point into the recording, which must outlive them
+  input_recording(const input_recording &) = delete;
+  input_recording &operator=(const input_recording &) = delete;
+
+  [[nodiscard]] std::span<const input_record> records() const noexcept {
+    return records_;
+  }
+
+private:
+  std::string data_;
+  std::vector<input_record> records_;
+};
+
+enum class replay_speed {
+  original, // Wait between records as long as the user did
+  fastest,
+};
+
+// Write the records of `recording` to `out`, typically the master side of a
+// pseudo terminal, one record at a time. Resizes set the size of `out` if
+// it is a pseudo terminal, which signals its foreground process group.
+inline void replay(const input_recording &recording, FILE *out,
+                   replay_speed speed = replay_speed::original) {
+  auto next = std::chrono::steady_clock::now();
+  for (const auto &record : recording.records()) {
+    if (speed == replay_speed::original) {
+      next += record.delay;
+      std::this_thread::sleep_until(next);
+    }
+    if (record.is_resize()) {
+      const winsize size{.ws_row = record.rows,
+                         .ws_col = record.columns,
+                         .ws_xpixel = 0,
+                         .ws_ypixel = 0};
+      ioctl(fileno(out), TIOCSWINSZ, &size);
+      continue;
+    }
+    fwrite(record.bytes.data(), 1, record.bytes.size(), out);
+    fflush(out);
+  }
+}
+
+} // namespace dpsg
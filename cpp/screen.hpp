@@ -0,0 +1,262 @@
+#pragma once
+
+#include "cursor.hpp"
+#include "style.hpp"
+#include "types.hpp"
+#include "vt100.hpp"
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+namespace dpsg::vt100 {
+
+struct cell {
+  char32_t code_point = U' ';
+  cell_style style;
+
+  constexpr bool operator==(const cell &) const noexcept = default;
+};
+
+namespace detail {
+// Decode the first code point of `text` and remove it. Invalid sequences
+// become U+FFFD, one byte at a time.
+constexpr char32_t next_code_point(std::string_view &text) noexcept {
+  const auto first = static_cast<u8>(text.front());
+  size_t length = 1;
+  char32_t result = first;
+  if (first >= 0xF0 && first < 0xF8) {
+    length = 4;
+    result = first & 0x07;
+  } else if (first >= 0xE0) {
+    length = 3;
+    result = first & 0x0F;
+  } else if (first >= 0xC0) {
+    length = 2;
+    result = first & 0x1F;
+  } else if (first >= 0x80) {
+    text.remove_prefix(1);
+    return U'\uFFFD';
+  }
+  if (length > text.size()) {
+    text.remove_prefix(1);
+    return U'\uFFFD';
+  }
+  for (size_t i = 1; i < length; ++i) {
+    const auto c = static_cast<u8>(text[i]);
+    if ((c & 0xC0) != 0x80) {
+      text.remove_prefix(1);
+      return U'\uFFFD';
+    }
+    result = (result << 6) | (c & 0x3F);
+  }
+  text.remove_prefix(length);
+  return result;
+}
+
+// Control characters would move the cursor or change the state of the
+// terminal instead of showing up, cells draw them as U+FFFD
+constexpr char32_t printable(char32_t c) noexcept {
+  return c < 0x20 || (c >= 0x7F && c < 0xA0) ? U'\uFFFD' : c;
+}
+static_assert(printable(U'\033') == U'\uFFFD' &&
+              printable(U'\x7F') == U'\uFFFD' &&
+              printable(U'\x9B') == U'\uFFFD');
+static_assert(printable(U' ') == U' ' && printable(U'\u00E9') == U'\u00E9');
+
+constexpr size_t utf8_size(char32_t c) noexcept {
+  return c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+}
+
+inline void append_utf8(frame_buffer &out, char32_t c) {
+  if (c < 0x80) {
+    out.push_back(static_cast<char>(c));
+  } else if (c < 0x800) {
+    const char bytes[] = {static_cast<char>(0xC0 | (c >> 6)),
+                          static_cast<char>(0x80 | (c & 0x3F))};
+    out.append({bytes, sizeof(bytes)});
+  } else if (c < 0x10000) {
+    const char bytes[] = {static_cast<char>(0xE0 | (c >> 12)),
+                          static_cast<char>(0x80 | ((c >> 6) & 0x3F)),
+                          static_cast<char>(0x80 | (c & 0x3F))};
+    out.append({bytes, sizeof(bytes)});
+  } else {
+    const char bytes[] = {static_cast<char>(0xF0 | (c >> 18)),
+                          static_cast<char>(0x80 | ((c >> 12) & 0x3F)),
+                          static_cast<char>(0x80 | ((c >> 6) & 0x3F)),
+                          static_cast<char>(0x80 | (c & 0x3F))};
+    out.append({bytes, sizeof(bytes)});
+  }
+}
+
+} // namespace detail
+
+// Model of the terminal screen, redrawn with as few bytes as possible.
+//
+// Drawing goes to the back grid. render() compares it with the front grid,
+// what the terminal displays since the last render(), and only writes the
+// runs of cells that changed, then makes the front grid match. The back grid
+// is kept, the next frame only needs to draw what's different:
+//
+//   screen s{columns, rows};
+//   for (;;) {
+//     s.put(0, 0, clock_text(), {.fg = color::green});
+//     s.render(frame);
+//     frame.flush(STDOUT_FILENO);
+//   }
+//
+// Only the rows drawn to since the last render() are compared. Moves between
+// changed runs go through cursor_planner, or write the unchanged cells in
+// between again when that's shorter. Every cell is one column wide.
+class screen {
+public:
+  screen(u16 columns, u16 rows) { resize(columns, rows); }
+
+  [[nodiscard]] u16 columns() const noexcept { return columns_; }
+  [[nodiscard]] u16 rows() const noexcept { return rows_; }
+
+  // Change the size of the screen, e.g. on a resize event. The content is
+  // cleared, and the whole screen is redrawn by the next render().
+  void resize(u16 columns, u16 rows) {
+    columns_ = columns;
+    rows_ = rows;
+    back_.assign(size_t{columns} * rows, cell{});
+    front_.resize(back_.size());
+    damage_.resize(rows);
+    invalidate();
+  }
+
+  // Forget what the terminal displays, e.g. after another program wrote to
+  // it. The whole screen is redrawn by the next render().
+  void invalidate() {
+    std::fill(front_.begin(), front_.end(), unknown);
+    std::fill(damage_.begin(), damage_.end(), row_damage{0, columns_});
+  }
+
+  [[nodiscard]] const cell &at(u16 x, u16 y) const noexcept {
+    return back_[index(x, y)];
+  }
+
+  // Control characters (C0, DEL and C1) are drawn as U+FFFD, here and in
+  // put() and fill()
+  void set(u16 x, u16 y, const cell &c) noexcept {
+    if (x < columns_ && y < rows_) {
+      back_[index(x, y)] = cell{detail::printable(c.code_point), c.style};
+      damage(x, y, 1);
+    }
+  }
+
+  // Write UTF-8 `text` from (x, y) on a single row, clipped to the screen.
+  // Returns the number of cells written.
+  u16 put(u16 x, u16 y, std::string_view text, cell_style style = {}) {
+    if (y >= rows_ || x >= columns_) {
+      return 0;
+    }
+    u16 end = x;
+    cell *row = &back_[index(0, y)];
+    while (!text.empty() && end < columns_) {
+      row[end++] =
+          cell{detail::printable(detail::next_code_point(text)), style};
+    }
+    damage(x, y, end - x);
+    return end - x;
+  }
+
+  // Fill a rectangle clipped to the screen with `c`
+  void fill(u16 x, u16 y, u16 width, u16 height, const cell &c) noexcept {
+    if (x >= columns_) {
+      return;
+    }
+    const cell drawn{detail::printable(c.code_point), c.style};
+    const u16 last_x = static_cast<u16>(std::min<u32>(u32{x} + width, columns_));
+    const u16 last_y = static_cast<u16>(std::min<u32>(u32{y} + height, rows_));
+    for (u16 row = y; row < last_y; ++row) {
+      std::fill(&back_[index(x, row)], &back_[index(0, row)] + last_x, drawn);
+      damage(x, row, last_x - x);
+    }
+  }
+
+  void clear(const cell &c = {}) noexcept { fill(0, 0, columns_, rows_, c); }
+
+  // Write to `out` what changed since the last call, and take it as
+  // displayed
+  void render(frame_buffer &out) {
+    // Where the terminal cursor is and the style it writes with, unknown at
+    // first since something else may have written in between
+    cursor_planner cursor{columns_};
+    style_writer style{out};
+
+    for (u16 y = 0; y < rows_; ++y) {
+      auto &[first, last] = damage_[y];
+      for (u16 x = first; x < last; ++x) {
+        const size_t i = index(x, y);
+        if (back_[i] == front_[i]) {
+          continue;
+        }
+        if (!reprint_up_to(out, cursor, style.style(), x, y)) {
+          cursor.move(out, x, y);
+        }
+        style.set(back_[i].style);
+        style.sync();
+        detail::append_utf8(out, back_[i].code_point);
+        cursor.advance(1);
+        front_[i] = back_[i];
+      }
+      first = columns_;
+      last = 0;
+    }
+  }
+
+private:
+  struct row_damage {
+    u16 first; // First column drawn to
+    u16 last;  // Past the last column drawn to
+  };
+
+  // Can't be drawn, so it always differs from the back grid
+  constexpr static inline cell unknown{static_cast<char32_t>(-1), {}};
+
+  u16 columns_ = 0;
+  u16 rows_ = 0;
+  std::vector<cell> back_;
+  std::vector<cell> front_;
+  std::vector<row_damage> damage_;
+
+  [[nodiscard]] size_t index(u16 x, u16 y) const noexcept {
+    return size_t{y} * columns_ + x;
+  }
+
+  // Move the cursor to (x, y) by writing again the cells it would move
+  // over, if they're on the same row, in the current style, and take fewer
+  // bytes than moving. Returns false if it didn't.
+  bool reprint_up_to(frame_buffer &out, cursor_planner &cursor,
+                     const cell_style &current, u16 x, u16 y) const {
+    if (!cursor.known() || cursor.y() != y || cursor.x() >= x) {
+      return false;
+    }
+    const size_t budget = cursor.cost(x, y);
+    size_t bytes = 0;
+    for (u16 column = cursor.x(); column < x; ++column) {
+      const cell &c = front_[index(column, y)];
+      bytes += detail::utf8_size(c.code_point);
+      if (bytes > budget || c.style != current) {
+        return false;
+      }
+    }
+    for (u16 column = cursor.x(); column < x; ++column) {
+      detail::append_utf8(out, front_[index(column, y)].code_point);
+    }
+    cursor.advance(static_cast<u16>(x - cursor.x()));
+    return true;
+  }
+
+  void damage(u16 x, u16 y, u16 count) noexcept {
+    if (count != 0) {
+      auto &[first, last] = damage_[y];
+      first = std::min(first, x);
+      last = std::max(last, static_cast<u16>(x + count));
+    }
+  }
+};
+
+} // namespace dpsg::vt100
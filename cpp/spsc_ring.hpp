@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <span>
+#include <type_traits>
+
+namespace dpsg {
+
+// Fixed capacity queue between exactly one producer thread and one consumer
+// thread. Neither side ever locks or makes a system call: each side owns one
+// index and only reads the other's, and keeps a stale copy of it to avoid
+// touching the other side's cache line when it doesn't need to.
+template <class T, size_t Capacity>
+  requires std::is_trivially_copyable_v<T> && (std::has_single_bit(Capacity))
+class spsc_ring {
+  // Typical cache line size, std::hardware_destructive_interference_size
+  // varies with compiler flags
+  constexpr static inline size_t cache_line = 64;
+
+public:
+  // Producer side. Returns the number of items pushed, less than
+  // items.size() if the ring is full.
+  size_t push(std::span<const T> items) noexcept {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (Capacity - (tail - cached_head_) < items.size()) {
+      cached_head_ = head_.load(std::memory_order_acquire);
+    }
+    const size_t count =
+        std::min(items.size(), Capacity - (tail - cached_head_));
+    for (size_t i = 0; i < count; ++i) {
+      items_[(tail + i) & (Capacity - 1)] = items[i];
+    }
+    tail_.store(tail + count, std::memory_order_release);
+    return count;
+  }
+
+  bool try_push(const T &item) noexcept { return push({&item, 1}) == 1; }
+
+  // Consumer side. Returns the number of items written to `out`, 0 if the
+  // ring is empty.
+  size_t pop(std::span<T> out) noexcept {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (cached_tail_ - head < out.size()) {
+      cached_tail_ = tail_.load(std::memory_order_acquire);
+    }
+    const size_t count = std::min(out.size(), cached_tail_ - head);
+    for (size_t i = 0; i < count; ++i) {
+      out[i] = items_[(head + i) & (Capacity - 1)];
+    }
+    head_.store(head + count, std::memory_order_release);
+    return count;
+  }
+
+  bool try_pop(T &item) noexcept { return pop({&item, 1}) == 1; }
+
+  // Exact only when called from one of the sides while the other is idle
+  [[nodiscard]] bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+           tail_.load(std::memory_order_acquire);
+  }
+
+  [[nodiscard]] constexpr static size_t capacity() noexcept {
+    return Capacity;
+  }
+
+private:
+  alignas(cache_line) std::atomic<size_t> head_{0}; // Written by the consumer
+  size_t cached_tail_ = 0;
+  alignas(cache_line) std::atomic<size_t> tail_{0}; // Written by the producer
+  size_t cached_head_ = 0;
+  alignas(cache_line) std::array<T, Capacity> items_;
+};
+
+} // namespace dpsg
@@ -0,0 +1,492 @@
+#pragma once
+
+#include "types.hpp"
+#include "vt100.hpp"
+
+#include <array>
+#include <bit>
+#include <span>
+#include <type_traits>
+#include <string_view>
+
+namespace dpsg::vt100 {
+
+// Color of text or background: the terminal's default, one of the 256 indexed colors (the
+// first 8 being enum color), or a true color
+class cell_color {
+public:
+  constexpr cell_color() noexcept = default;
+  constexpr cell_color(color c) noexcept
+      : value_{indexed_tag | static_cast<u8>(c)} {}
+
+  constexpr static cell_color indexed(u8 index) noexcept {
+    return cell_color{indexed_tag | index};
+  }
+  constexpr static cell_color rgb(u8 r, u8 g, u8 b) noexcept {
+    return cell_color{rgb_tag | (u32{r} << 16) | (u32{g} << 8) | b};
+  }
+
+  [[nodiscard]] constexpr bool is_default() const noexcept {
+    return value_ == 0;
+  }
+  [[nodiscard]] constexpr bool is_indexed() const noexcept {
+    return (value_ & tag_mask) == indexed_tag;
+  }
+  [[nodiscard]] constexpr bool is_rgb() const noexcept {
+    return (value_ & tag_mask) == rgb_tag;
+  }
+  [[nodiscard]] constexpr u8 index() const noexcept {
+    return static_cast<u8>(value_);
+  }
+  [[nodiscard]] constexpr u8 r() const noexcept {
+    return static_cast<u8>(value_ >> 16);
+  }
+  [[nodiscard]] constexpr u8 g() const noexcept {
+    return static_cast<u8>(value_ >> 8);
+  }
+  [[nodiscard]] constexpr u8 b() const noexcept {
+    return static_cast<u8>(value_);
+  }
+
+  constexpr bool operator==(const cell_color &) const noexcept = default;
+
+private:
+  constexpr static inline u32 indexed_tag = 1u << 24;
+  constexpr static inline u32 rgb_tag = 2u << 24;
+  constexpr static inline u32 tag_mask = 0xFFu << 24;
+
+  constexpr explicit cell_color(u32 value) noexcept : value_{value} {}
+
+  u32 value_ = 0;
+};
+
+// SGR attributes, one bit each
+enum class attribute : u8 {
+  none = 0,
+  bold = 1 << 0,
+  faint = 1 << 1,
+  italic = 1 << 2,
+  underline = 1 << 3,
+  blink = 1 << 4,
+  reverse = 1 << 5,
+  conceal = 1 << 6,
+  crossed = 1 << 7,
+};
+
+constexpr attribute operator|(attribute left, attribute right) noexcept {
+  return static_cast<attribute>(static_cast<u8>(left) |
+                                static_cast<u8>(right));
+}
+constexpr attribute operator&(attribute left, attribute right) noexcept {
+  return static_cast<attribute>(static_cast<u8>(left) &
+                                static_cast<u8>(right));
+}
+
+struct cell_style {
+  cell_color fg;
+  cell_color bg;
+  attribute attributes = attribute::none;
+
+  constexpr bool operator==(const cell_style &) const noexcept = default;
+};
+
+constexpr attribute operator~(attribute value) noexcept {
+  return static_cast<attribute>(~static_cast<u8>(value));
+}
+
+namespace detail {
+// Attribute set by each SGR code below 10, and reset by that code plus 20.
+// At namespace scope, a local array would be built again on every call.
+constexpr inline attribute sgr_attribute_by_code[] = {
+    attribute::none,    attribute::bold,      attribute::faint,
+    attribute::italic,  attribute::underline, attribute::blink,
+    attribute::none,    attribute::reverse,   attribute::conceal,
+    attribute::crossed,
+};
+
+// SGR code setting each bit of attribute
+constexpr inline uint8_t sgr_code_by_attribute[] = {1, 2, 3, 4, 5, 7, 8, 9};
+} // namespace detail
+
+// Apply the codes of an SGR sequence to `style`. Codes that aren't colors or
+// attributes are ignored.
+constexpr cell_style apply_sgr(cell_style style,
+                               std::span<const uint8_t> codes) noexcept {
+  constexpr const auto &by_code = detail::sgr_attribute_by_code;
+  for (size_t i = 0; i < codes.size(); ++i) {
+    const uint8_t code = codes[i];
+    const uint8_t digit = code % 10;
+    // Codes come in groups of 10, a jump table picks the group
+    switch (code / 10) {
+    case 0: // Reset, or set an attribute
+      if (code == 0) {
+        style = {};
+      } else {
+        style.attributes = style.attributes | by_code[code];
+      }
+      break;
+    case 2: // Reset attributes, 22 resets both bold and faint
+      if (code == 22) {
+        style.attributes =
+            style.attributes & ~(attribute::bold | attribute::faint);
+      } else if (code > 22) {
+        style.attributes = style.attributes & ~by_code[digit];
+      }
+      break;
+    case 3:
+    case 4: { // Colors, default colors, and extended colors
+      cell_color &target = code < 40 ? style.fg : style.bg;
+      if (digit < 8) {
+        target = cell_color::indexed(digit);
+      } else if (digit == 9) {
+        target = cell_color{};
+      } else if (i + 2 < codes.size() && codes[i + 1] == 5) {
+        target = cell_color::indexed(codes[i + 2]);
+        i += 2;
+      } else if (i + 4 < codes.size() && codes[i + 1] == 2) {
+        target = cell_color::rgb(codes[i + 2], codes[i + 3], codes[i + 4]);
+        i += 4;
+      }
+      break;
+    }
+    case 9:
+    case 10: // Bright colors
+      if (digit < 8) {
+        (code < 100 ? style.fg : style.bg) =
+            cell_color::indexed(static_cast<u8>(digit + 8));
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  return style;
+}
+
+namespace detail {
+// Longest SGR sequence for a style: a reset, 8 attributes and 2 true colors
+constexpr size_t max_sgr_size = 64;
+
+constexpr char *sgr_parameter(char *out, uint8_t code) noexcept {
+  *out++ = ';';
+  return render_code(out, code);
+}
+
+constexpr char *sgr_color(char *out, cell_color c, uint8_t base) noexcept {
+  if (c.is_default()) {
+    return sgr_parameter(out, base + 9);
+  }
+  if (c.is_indexed() && c.index() < 8) {
+    return sgr_parameter(out, base + c.index());
+  }
+  if (c.is_indexed() && c.index() < 16) {
+    return sgr_parameter(out, base + 60 + c.index() - 8);
+  }
+  out = sgr_parameter(out, base + 8);
+  if (c.is_indexed()) {
+    out = sgr_parameter(out, 5);
+    return sgr_parameter(out, c.index());
+  }
+  out = sgr_parameter(out, 2);
+  out = sgr_parameter(out, c.r());
+  out = sgr_parameter(out, c.g());
+  return sgr_parameter(out, c.b());
+}
+
+// Parameters setting or resetting the attributes of `bits`
+constexpr char *sgr_attributes(char *out, attribute bits, bool set) noexcept {
+  constexpr attribute intensity = attribute::bold | attribute::faint;
+  if (!set && (bits & intensity) != attribute::none) {
+    out = sgr_parameter(out, 22); // Resets both bold and faint
+    bits = bits & ~intensity;
+  }
+  // Only visit the bits that are set, usually none or one
+  for (auto rest = static_cast<u8>(bits); rest != 0; rest &= rest - 1) {
+    const auto bit = std::countr_zero(rest);
+    // Codes are a single digit, reset codes are 20 more
+    *out++ = ';';
+    if (!set) {
+      *out++ = '2';
+    }
+    *out++ = static_cast<char>('0' + sgr_code_by_attribute[bit]);
+  }
+  return out;
+}
+
+// Characters written by sgr_parameter(), sgr_color() and sgr_attributes()
+constexpr size_t sgr_parameter_size(uint8_t code) noexcept {
+  return code >= 100 ? 4 : code >= 10 ? 3 : 2;
+}
+
+constexpr size_t sgr_color_size(cell_color c, uint8_t base) noexcept {
+  if (c.is_default() || (c.is_indexed() && c.index() < 8)) {
+    return 3;
+  }
+  if (c.is_indexed() && c.index() < 16) {
+    return sgr_parameter_size(base + 60);
+  }
+  if (c.is_indexed()) {
+    return 5 + sgr_parameter_size(c.index()); // ;38;5;<index>
+  }
+  return 5 + sgr_parameter_size(c.r()) + sgr_parameter_size(c.g()) +
+         sgr_parameter_size(c.b());
+}
+
+constexpr size_t sgr_attributes_size(attribute bits, bool set) noexcept {
+  constexpr attribute intensity = attribute::bold | attribute::faint;
+  const auto count = [](attribute a) {
+    return static_cast<size_t>(std::popcount(static_cast<u8>(a)));
+  };
+  if (set) {
+    return 2 * count(bits);
+  }
+  const bool resets_intensity = (bits & intensity) != attribute::none;
+  return (resets_intensity ? 3 : 0) + 3 * count(bits & ~intensity);
+}
+
+// Write the shortest SGR sequence switching from `from` to `to`, which may
+// be empty, to `out` (at least max_sgr_size bytes). `from` is null if the
+// current state is unknown. Returns the end of what was written.
+//
+// The sequence either resets then sets everything `to` has, or only changes
+// what differs from `from`. Both sizes are computed first, and only the
+// shorter one is written. Going to or from the default style, the answer is
+// known without computing them.
+constexpr char *sgr_transition(char *out, const cell_style *from,
+                               const cell_style &to) noexcept {
+  if (from != nullptr && *from == to) {
+    return out;
+  }
+
+  if (to == cell_style{}) {
+    // Parameters resetting anything take at least 3 characters, ";0" is 2
+    return std::copy_n("\033[0m", 4, out);
+  }
+
+  // The parameters start with a ';', which becomes the '[' of the CSI
+  *out++ = '\033';
+  char *const first = out;
+
+  // From the default style, changing what differs is the reset without ";0"
+  const bool from_default = from != nullptr && *from == cell_style{};
+  if (from != nullptr && !from_default) {
+    const attribute removed = from->attributes & ~to.attributes;
+    attribute added = to.attributes & ~from->attributes;
+    constexpr attribute intensity = attribute::bold | attribute::faint;
+    if ((removed & intensity) != attribute::none) {
+      // 22 resets both, set the one that stays again
+      added = added | (to.attributes & intensity);
+    }
+    const size_t delta_size =
+        sgr_attributes_size(removed, false) + sgr_attributes_size(added, true) +
+        (from->fg != to.fg ? sgr_color_size(to.fg, 30) : 0) +
+        (from->bg != to.bg ? sgr_color_size(to.bg, 40) : 0);
+    const size_t reset_size =
+        2 + sgr_attributes_size(to.attributes, true) +
+        (to.fg.is_default() ? 0 : sgr_color_size(to.fg, 30)) +
+        (to.bg.is_default() ? 0 : sgr_color_size(to.bg, 40));
+    if (delta_size <= reset_size) {
+      out = sgr_attributes(out, removed, false);
+      out = sgr_attributes(out, added, true);
+      if (from->fg != to.fg) {
+        out = sgr_color(out, to.fg, 30);
+      }
+      if (from->bg != to.bg) {
+        out = sgr_color(out, to.bg, 40);
+      }
+      *first = '[';
+      *out++ = 'm';
+      return out;
+    }
+  }
+
+  if (!from_default) {
+    out = sgr_parameter(out, 0);
+  }
+  out = sgr_attributes(out, to.attributes, true);
+  if (!to.fg.is_default()) {
+    out = sgr_color(out, to.fg, 30);
+  }
+  if (!to.bg.is_default()) {
+    out = sgr_color(out, to.bg, 40);
+  }
+  *first = '[';
+  *out++ = 'm';
+  return out;
+}
+
+// sgr_transition() as a string, for the checks below
+constexpr rendered_termcode<max_sgr_size>
+render_sgr_transition(const cell_style *from, const cell_style &to) noexcept {
+  rendered_termcode<max_sgr_size> result;
+  result.size = static_cast<size_t>(
+      sgr_transition(result.data, from, to) - result.data);
+  return result;
+}
+constexpr rendered_termcode<max_sgr_size>
+render_sgr_transition(cell_style from, const cell_style &to) noexcept {
+  return render_sgr_transition(&from, to);
+}
+constexpr rendered_termcode<max_sgr_size>
+render_sgr_transition(const cell_style &to) noexcept {
+  return render_sgr_transition(nullptr, to);
+}
+
+constexpr cell_style bold_style{
+    .fg = {}, .bg = {}, .attributes = attribute::bold};
+constexpr cell_style bold_green_style{
+    .fg = color::green, .bg = {}, .attributes = attribute::bold};
+} // namespace detail
+
+static_assert(apply_sgr({}, (bold | green).codes) == detail::bold_green_style);
+static_assert(apply_sgr(detail::bold_green_style,
+                        std::array<uint8_t, 4>{22, 48, 5, 200}) ==
+              cell_style{.fg = color::green,
+                         .bg = cell_color::indexed(200),
+                         .attributes = attribute::none});
+static_assert(apply_sgr({}, setf(0, 128, 255).codes).fg ==
+              cell_color::rgb(0, 128, 255));
+static_assert(apply_sgr(detail::bold_green_style, reset.codes) == cell_style{});
+
+// Unknown state: a reset, then what's set
+static_assert(detail::render_sgr_transition({}).view() == "\033[0m");
+static_assert(detail::render_sgr_transition(detail::bold_green_style).view() ==
+              "\033[0;1;32m");
+// Only what changed, unless a reset is shorter
+static_assert(detail::render_sgr_transition(detail::bold_style,
+                                            detail::bold_green_style)
+                  .view() == "\033[32m");
+static_assert(detail::render_sgr_transition(detail::bold_green_style, {})
+                  .view() == "\033[0m");
+static_assert(detail::render_sgr_transition(detail::bold_green_style,
+                                            detail::bold_green_style)
+                  .view()
+                  .empty());
+static_assert(detail::render_sgr_transition(
+                  cell_style{}, {.fg = cell_color::rgb(0, 128, 255),
+                                 .bg = cell_color::indexed(9),
+                                 .attributes = attribute::none})
+                  .view() == "\033[38;2;0;128;255;101m");
+static_assert(detail::render_sgr_transition(
+                  {.fg = {}, .bg = {}, .attributes = attribute::italic},
+                  {.fg = {}, .bg = {}, .attributes = attribute::underline})
+                  .view() == "\033[0;4m");
+// 22 resets both bold and faint, faint is set again
+static_assert(detail::render_sgr_transition(
+                  {.fg = color::red,
+                   .bg = color::blue,
+                   .attributes = attribute::bold | attribute::faint},
+                  {.fg = color::red,
+                   .bg = color::blue,
+                   .attributes = attribute::faint})
+                  .view() == "\033[22;2m");
+
+namespace detail {
+// Types that style_writer doesn't write as is: styles, including types
+// deriving from them (rgb, decorate_sw), and combinations of termcodes,
+// written one at a time by the generic operator<<
+template <std::size_t S>
+std::true_type changes_style_test(const termcode_sequence<S, 'm'> *);
+template <std::size_t S, class T>
+std::true_type changes_style_test(const generic_decorate<S, T> *);
+template <class... Ts>
+std::true_type changes_style_test(const termcode_tuple<Ts...> *);
+std::false_type changes_style_test(const void *);
+
+template <class T>
+concept changes_style =
+    decltype(changes_style_test(static_cast<const T *>(nullptr)))::value;
+} // namespace detail
+
+// Writes styled text to `Sink` (std::ostream, frame_buffer...) keeping track
+// of the terminal's current colors and attributes, so that only what
+// changes between two spans of text is written:
+//
+//   style_writer w{std::cout};
+//   for (const auto &row : table) {
+//     w << decorate(bold, row.name) << ' ' << decorate(green, row.value)
+//       << '\n';
+//   }
+//
+// Styles are applied lazily, right before the text they affect: changing
+// the style twice in a row, or setting it back to what it was, writes
+// nothing. Color and attribute termcodes (red, bold | underline, setf(...))
+// change the style, decorate() styles a single value and returns to the
+// default style after it, like it does on a stream. Everything else is
+// written as is, after bringing the terminal up to date.
+//
+// The writer assumes that nothing else changes the terminal's style while it
+// is in use, see invalidate(). It restores the default style when it's
+// destroyed.
+template <class Sink> class style_writer {
+public:
+  explicit style_writer(Sink &out) noexcept : out_{out} {}
+
+  style_writer(const style_writer &) = delete;
+  style_writer &operator=(const style_writer &) = delete;
+
+  ~style_writer() {
+    if (known_ && !(current_ == cell_style{})) {
+      set(cell_style{});
+      try {
+        sync();
+      } catch (...) {
+        // The sink failed, there's nothing left to restore the style on
+      }
+    }
+  }
+
+  // Style of the next text
+  void set(const cell_style &style) noexcept { pending_ = style; }
+  [[nodiscard]] const cell_style &style() const noexcept { return pending_; }
+
+  // Write the sequence bringing the terminal to the current style, if it
+  // isn't there already
+  void sync() {
+    if (!known_ || !(current_ == pending_)) {
+      char buffer[detail::max_sgr_size];
+      const char *end = detail::sgr_transition(
+          buffer, known_ ? &current_ : nullptr, pending_);
+      out_ << std::string_view{buffer, static_cast<size_t>(end - buffer)};
+      current_ = pending_;
+      known_ = true;
+    }
+  }
+
+  // Forget the style of the terminal, e.g. after something else wrote to
+  // it. The next sync() writes the whole style.
+  void invalidate() noexcept { known_ = false; }
+
+  template <std::size_t S>
+  style_writer &operator<<(const color_termcode_sequence<S> &codes) noexcept {
+    if constexpr (S > 0) {
+      pending_ = apply_sgr(pending_, codes.codes);
+    }
+    return *this;
+  }
+
+  template <std::size_t S, class T>
+  style_writer &operator<<(const generic_decorate<S, T> &d) {
+    *this << d.codes;
+    sync();
+    out_ << d.value;
+    pending_ = {};
+    return *this;
+  }
+
+  template <class T>
+    requires(!detail::changes_style<T>)
+  style_writer &operator<<(const T &value) {
+    sync();
+    out_ << value;
+    return *this;
+  }
+
+private:
+  Sink &out_;
+  cell_style pending_;  // Style of the next text
+  cell_style current_;  // Style of the terminal, if known_
+  bool known_ = false;
+};
+
+} // namespace dpsg::vt100
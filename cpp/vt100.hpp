@@ -1,11 +1,24 @@
 #ifndef HEADER_GUARD_DPSG_VT100_HPP
 #define HEADER_GUARD_DPSG_VT100_HPP
 
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <concepts>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <ostream>
+#include <string_view>
+#include <system_error>
 #include <tuple>
 
+extern "C" {
+#include <unistd.h>
+}
+
 namespace dpsg::vt100 {
 // TYPES & OPERATIONS
 template <std::size_t S, char End = 0, char Begin = 0>
@@ -36,7 +49,7 @@ template <class... Ts, class... Us>
 constexpr auto operator|(termcode_tuple<Ts...> t1,
                          termcode_tuple<Us...> t2) noexcept {
   return termcode_tuple{std::tuple_cat(static_cast<std::tuple<Ts...>>(t1),
-                                       static_cas<std::tuple<Us...>>(t2))};
+                                       static_cast<std::tuple<Us...>>(t2))};
 }
 
 template <class... Ts, size_t S, char E, char B>
@@ -90,9 +103,9 @@ std::basic_ostream<C> &operator<<(std::basic_ostream<C> &os,
   }
   if constexpr (S > 0) {
     os << static_cast<int>(s.codes[0]);
-  }
-  for (std::size_t i = 1; i < S; ++i) {
-    os << ';' << static_cast<int>(s.codes[i]);
+    for (std::size_t i = 1; i < S; ++i) {
+      os << ';' << static_cast<int>(s.codes[i]);
+    }
   }
   if constexpr (End != 0) {
     os << End;
@@ -102,10 +115,115 @@ std::basic_ostream<C> &operator<<(std::basic_ostream<C> &os,
 
 template <class... Ts>
 constexpr decltype(auto) operator<<(auto &os, detail::termcode_tuple<Ts...> t) {
-  ((os << std::get<Ts>(t)), ...);
+  std::apply([&os](const auto &...codes) { ((os << codes), ...); },
+             static_cast<const std::tuple<Ts...> &>(t));
   return os;
 }
 
+// PRE-RENDERED TERMCODES
+
+// Bytes of a termcode (or a combination of termcodes), rendered once,
+// usually at compile time:
+//
+//   constexpr static auto title_style = render(bold | underline | red);
+//   std::cout << title_style << "Title";
+//
+// Writing it is then a single copy, without formatting any code. Capacity is
+// an upper bound computed from the type, size is the actual length.
+template <std::size_t Capacity> struct rendered_termcode {
+  char data[Capacity]{};
+  std::size_t size = 0;
+
+  [[nodiscard]] constexpr std::string_view view() const noexcept {
+    return {data, size};
+  }
+  constexpr operator std::string_view() const noexcept { return view(); }
+};
+
+namespace detail {
+// ESC, '[', Begin, End, and up to 3 digits and a separator per code
+template <std::size_t S> constexpr std::size_t max_rendered_size = 4 + 4 * S;
+
+// Decimal digits of `code`. Codes of termcodes have at most 3, but cursor
+// positions and counts may have more.
+constexpr char *render_code(char *out, uint32_t code) noexcept {
+  if (code >= 1000) {
+    out = render_code(out, code / 1000);
+    code %= 1000;
+    *out++ = static_cast<char>('0' + code / 100);
+    *out++ = static_cast<char>('0' + code / 10 % 10);
+    *out++ = static_cast<char>('0' + code % 10);
+    return out;
+  }
+  if (code >= 100) {
+    *out++ = static_cast<char>('0' + code / 100);
+    code %= 100;
+    *out++ = static_cast<char>('0' + code / 10);
+  } else if (code >= 10) {
+    *out++ = static_cast<char>('0' + code / 10);
+  }
+  *out++ = static_cast<char>('0' + code % 10);
+  return out;
+}
+
+// Write `s` to `out`, which must have room for max_rendered_size<S> bytes.
+// Returns the end of what was written.
+template <std::size_t S, char End, char Begin>
+constexpr char *render_to(char *out,
+                          const termcode_sequence<S, End, Begin> &s) noexcept {
+  *out++ = '\033';
+  if constexpr (S > 0) {
+    *out++ = '[';
+  }
+  if constexpr (Begin != 0) {
+    *out++ = Begin;
+  }
+  if constexpr (S > 0) {
+    out = render_code(out, s.codes[0]);
+    for (std::size_t i = 1; i < S; ++i) {
+      *out++ = ';';
+      out = render_code(out, s.codes[i]);
+    }
+  }
+  if constexpr (End != 0) {
+    *out++ = End;
+  }
+  return out;
+}
+
+template <class T> struct termcode_size;
+template <std::size_t S, char End, char Begin>
+struct termcode_size<termcode_sequence<S, End, Begin>>
+    : std::integral_constant<std::size_t, max_rendered_size<S>> {};
+} // namespace detail
+
+template <std::size_t S, char End, char Begin>
+constexpr auto render(const termcode_sequence<S, End, Begin> &s) noexcept {
+  rendered_termcode<detail::max_rendered_size<S>> result;
+  result.size =
+      static_cast<std::size_t>(detail::render_to(result.data, s) - result.data);
+  return result;
+}
+
+template <class... Ts>
+constexpr auto render(const detail::termcode_tuple<Ts...> &t) noexcept {
+  rendered_termcode<(detail::termcode_size<Ts>::value + ...)> result;
+  std::apply(
+      [&result](const auto &...codes) {
+        char *out = result.data;
+        ((out = detail::render_to(out, codes)), ...);
+        result.size = static_cast<std::size_t>(out - result.data);
+      },
+      static_cast<const std::tuple<Ts...> &>(t));
+  return result;
+}
+
+template <class C, std::size_t N>
+std::basic_ostream<C> &operator<<(std::basic_ostream<C> &os,
+                                  const rendered_termcode<N> &r) {
+  return os.write(r.data, static_cast<std::streamsize>(r.size));
+}
+
 // BASIC COLORS
 enum class color : uint8_t {
   black = 0,
@@ -210,6 +328,12 @@ constexpr inline detail::rgb setb(uint8_t r, uint8_t g, uint8_t b) noexcept {
   return detail::rgb{{48, 2, r, g, b}};
 }
 
+static_assert(render(red).view() == "\033[31m");
+static_assert(render(bold | red | hide_cursor).view() ==
+              "\033[1;31m\033[?25l");
+static_assert(render(bold | red).view() == "\033[1;31m");
+static_assert(render(setf(0, 128, 255)).view() == "\033[38;2;0;128;255m");
+
 // UTILITY
 template <size_t S, typename T> struct generic_decorate {
   termcode_sequence<S, 'm'> codes;
@@ -250,6 +374,142 @@ template <size_t S, typename T>
 std::ostream &operator<<(std::ostream &os, const generic_decorate<S, T> &d) {
   return os << d.codes << d.value << reset;
 }
+
+// FRAME BUFFER
+
+// Contiguous buffer to build a whole frame in, and write it to the terminal
+// at once with flush(). Takes the same termcodes and decorated values as
+// std::ostream, without going through a streambuf for every character:
+//
+//   frame_buffer frame;
+//   frame << clear << set_cursor(1, 1) << bold << red << "Hello" << reset;
+//   frame.flush(STDOUT_FILENO);
+//
+// The memory is kept between frames, so that drawing frames of similar size
+// stops allocating after the first one.
+class frame_buffer {
+public:
+  frame_buffer() = default;
+  explicit frame_buffer(size_t capacity) { reserve(capacity); }
+
+  void append(std::string_view text) {
+    std::memcpy(grow(text.size()), text.data(), text.size());
+    size_ += text.size();
+  }
+
+  void push_back(char c) {
+    *grow(1) = c;
+    ++size_;
+  }
+
+  template <std::size_t S, char End, char Begin>
+  void append(const termcode_sequence<S, End, Begin> &s) {
+    char *out = grow(detail::max_rendered_size<S>);
+    size_ += static_cast<size_t>(detail::render_to(out, s) - out);
+  }
+
+  template <std::integral T> void append_integer(T value) {
+    char *out = grow(std::numeric_limits<T>::digits10 + 2);
+    size_ += static_cast<size_t>(
+        std::to_chars(out, out + std::numeric_limits<T>::digits10 + 2, value)
+            .ptr -
+        out);
+  }
+
+  // Write the whole buffer to `fd`, retrying on partial writes, and empty
+  // it. Throws std::system_error if the write fails, keeping what wasn't
+  // written.
+  void flush(int fd) {
+    size_t written = 0;
+    while (written < size_) {
+      const auto result = write(fd, data_.get() + written, size_ - written);
+      if (result < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        const int error = errno;
+        std::memmove(data_.get(), data_.get() + written, size_ - written);
+        size_ -= written;
+        throw std::system_error(error, std::generic_category(),
+                                "frame_buffer::flush");
+      }
+      written += static_cast<size_t>(result);
+    }
+    size_ = 0;
+  }
+
+  void reserve(size_t capacity) {
+    if (capacity > capacity_) {
+      auto data = std::make_unique_for_overwrite<char[]>(capacity);
+      if (size_ != 0) {
+        std::memcpy(data.get(), data_.get(), size_);
+      }
+      data_ = std::move(data);
+      capacity_ = capacity;
+    }
+  }
+
+  void clear() noexcept { size_ = 0; }
+
+  [[nodiscard]] std::string_view view() const noexcept {
+    return {data_.get(), size_};
+  }
+  [[nodiscard]] const char *data() const noexcept { return data_.get(); }
+  [[nodiscard]] size_t size() const noexcept { return size_; }
+  [[nodiscard]] size_t capacity() const noexcept { return capacity_; }
+  [[nodiscard]] bool empty() const noexcept { return size_ == 0; }
+
+private:
+  std::unique_ptr<char[]> data_;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+
+  // Room for at least `count` more bytes, returns where they go
+  char *grow(size_t count) {
+    if (capacity_ - size_ < count) {
+      reserve(std::max({size_ + count, 2 * capacity_, size_t{256}}));
+    }
+    return data_.get() + size_;
+  }
+};
+
+inline frame_buffer &operator<<(frame_buffer &buffer, std::string_view text) {
+  buffer.append(text);
+  return buffer;
+}
+
+inline frame_buffer &operator<<(frame_buffer &buffer, char c) {
+  buffer.push_back(c);
+  return buffer;
+}
+
+// Characters are written as such, like std::ostream does
+template <std::integral T>
+  requires(!std::same_as<T, bool> && !std::same_as<T, char> &&
+           !std::same_as<T, signed char> && !std::same_as<T, unsigned char>)
+frame_buffer &operator<<(frame_buffer &buffer, T value) {
+  buffer.append_integer(value);
+  return buffer;
+}
+
+template <std::size_t S, char End, char Begin>
+frame_buffer &operator<<(frame_buffer &buffer,
+                         const termcode_sequence<S, End, Begin> &s) {
+  buffer.append(s);
+  return buffer;
+}
+
+template <std::size_t N>
+frame_buffer &operator<<(frame_buffer &buffer, const rendered_termcode<N> &r) {
+  buffer.append(r.view());
+  return buffer;
+}
+
+template <size_t S, typename T>
+frame_buffer &operator<<(frame_buffer &buffer,
+                         const generic_decorate<S, T> &d) {
+  return buffer << d.codes << d.value << reset;
+}
 } // namespace dpsg::vt100
 
 #endif // HEADER_GUARD_DPSG_VT100_HPP
@@ -0,0 +1,167 @@
+// End to end benchmark of the input path: recorded key, mouse and paste
+// streams are written to the master side of a pseudo terminal, one sequence
+// at a time, while raw_mode_context reads the slave side. Every scenario is
+// replayed as fast as possible to measure throughput, then at a fixed rate
+// to measure the latency from the write of a sequence to the yield of its
+// last event, as a user would experience it.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "latency_histogram.hpp"
+#include "linux_term.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <pty.h>
+}
+
+namespace {
+
+using namespace dpsg;
+using clock_type = std::chrono::steady_clock;
+
+struct scenario {
+  const char *name;
+  std::vector<std::string> sequences; // Written one at a time
+  size_t repetitions;                 // Of the whole list
+};
+
+std::vector<scenario> scenarios() {
+  std::vector<scenario> result;
+
+  auto &typing = result.emplace_back(scenario{"typing", {}, 400});
+  for (char c : std::string_view{"The quick brown fox jumps over the lazy "
+                                 "dog, 0123456789!\r"}) {
+    typing.sequences.emplace_back(1, c);
+  }
+
+  result.push_back(scenario{"keys",
+                            {"\033[A", "\033[B", "\033[C", "\033[D",
+                             "\033[1;5C", "\033[1;2D", "\033[3~", "\033[5~",
+                             "\033OP", "\033[15;3~", "\033a", "\x7f"},
+                            2000});
+
+  auto &mouse = result.emplace_back(scenario{"mouse", {}, 200});
+  for (int i = 1; i <= 100; ++i) {
+    mouse.sequences.push_back("\033[<35;" + std::to_string(i) + ";" +
+                              std::to_string(i / 2 + 1) + "M");
+  }
+  mouse.sequences.emplace_back("\033[<0;100;51M");
+  mouse.sequences.emplace_back("\033[<0;100;51m");
+  mouse.sequences.emplace_back("\033[<64;100;51M");
+
+  std::string text;
+  while (text.size() < 1024) {
+    text += "int main() { return 0; }\n";
+  }
+  result.push_back(scenario{"paste", {"\033[200~" + text + "\033[201~"}, 500});
+
+  return result;
+}
+
+// Number of events produced by each sequence on its own
+std::vector<size_t> count_events(const std::vector<std::string> &sequences) {
+  std::vector<size_t> counts;
+  event events[64];
+  for (const auto &sequence : sequences) {
+    input_parser parser;
+    std::span<const char> input{sequence.data(), sequence.size()};
+    size_t count = 0;
+    while (!input.empty()) {
+      auto [consumed, written] = parser.parse(input, events);
+      input = input.subspan(consumed);
+      count += written;
+    }
+    counts.push_back(count);
+  }
+  return counts;
+}
+
+struct result {
+  size_t events;
+  std::chrono::duration<double> elapsed;
+  latency_histogram<> latency;
+};
+
+// Write the sequences of `s` to `master` every `period` (as fast as
+// possible if zero), and time the events coming out of `stream`
+template <class Stream>
+std::unique_ptr<result> replay(const scenario &s, int master, Stream &stream,
+                               std::chrono::nanoseconds period) {
+  const auto counts = count_events(s.sequences);
+  const size_t writes = s.sequences.size() * s.repetitions;
+  std::vector<std::atomic<clock_type::rep>> written_at(writes);
+
+  auto r = std::make_unique<result>();
+  const auto start = clock_type::now();
+  std::thread writer{[&] {
+    for (size_t i = 0; i < writes; ++i) {
+      if (period != std::chrono::nanoseconds{0}) {
+        std::this_thread::sleep_until(start + i * period);
+      }
+      const auto &sequence = s.sequences[i % s.sequences.size()];
+      written_at[i].store(clock_type::now().time_since_epoch().count(),
+                          std::memory_order_release);
+      write(master, sequence.data(), sequence.size());
+    }
+  }};
+
+  for (size_t i = 0; i < writes; ++i) {
+    for (size_t n = counts[i % counts.size()]; n != 0;) {
+      // A paste split between reads comes in several parts
+      if (!stream().first.is_partial_paste_event()) {
+        --n;
+      }
+      ++r->events;
+    }
+    const clock_type::time_point sent{clock_type::duration{
+        written_at[i].load(std::memory_order_acquire)}};
+    r->latency.record(clock_type::now() - sent);
+  }
+  r->elapsed = clock_type::now() - start;
+  writer.join();
+  return r;
+}
+
+void report(FILE *out, const char *name, const char *rate, const result &r) {
+  const auto us = [](std::chrono::nanoseconds d) { return d.count() / 1e3; };
+  fprintf(out, "%-7s %-10s %10.0f events/s  p50 %8.2fus  p99 %8.2fus\n", name,
+          rate, static_cast<double>(r.events) / r.elapsed.count(),
+          us(r.latency.percentile(50)), us(r.latency.percentile(99)));
+}
+
+} // namespace
+
+int main() {
+  // The context takes over stdin and stdout, keep the real stdout around
+  FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+  int master = -1;
+  int slave = -1;
+  if (out == nullptr ||
+      openpty(&master, &slave, nullptr, nullptr, nullptr) == -1) {
+    perror("input");
+    return 1;
+  }
+  dup2(slave, STDIN_FILENO);
+  dup2(slave, STDOUT_FILENO);
+
+  constexpr auto paced = std::chrono::microseconds{500}; // 2000 writes/s
+  {
+    raw_mode_context ctx;
+    auto stream = ctx.event_view_stream<4096, -1>();
+    for (const auto &s : scenarios()) {
+      report(out, s.name, "max rate",
+             *replay(s, master, stream, std::chrono::nanoseconds{0}));
+      scenario short_run = s;
+      short_run.repetitions = std::max<size_t>(1, s.repetitions / 10);
+      report(out, s.name, "2000/s", *replay(short_run, master, stream, paced));
+    }
+  }
+  fclose(out);
+}
@@ -0,0 +1,176 @@
+// Cost of drawing full screen frames: every cell of a 200x60 screen gets its
+// own true color and character, written once through std::ostream and once
+// through vt100::frame_buffer. Frames go to /dev/null so that only the
+// formatting and the system calls are measured, not the terminal.
+//
+// Then a mostly static dashboard, where a few values change every tick, is
+// drawn in full every frame and through vt100::screen, which only writes
+// what changed. Last, a table whose columns are decorated values is written
+// as is and through vt100::style_writer, which skips redundant styles.
+
+#include "screen.hpp"
+#include "style.hpp"
+#include "vt100.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+namespace {
+
+using namespace dpsg::vt100;
+using clock_type = std::chrono::steady_clock;
+
+constexpr int columns = 200;
+constexpr int rows = 60;
+constexpr int frames = 500;
+
+template <class Sink> void draw(Sink &out, int frame) {
+  out << home_cursor;
+  for (int y = 0; y < rows; ++y) {
+    out << set_cursor(static_cast<uint8_t>(y + 1), 1);
+    for (int x = 0; x < columns; ++x) {
+      out << setf(static_cast<uint8_t>(x + frame), static_cast<uint8_t>(y),
+                  128)
+          << static_cast<char>('a' + (x + y + frame) % 26);
+    }
+  }
+  out << reset;
+}
+
+void report(const char *name, clock_type::duration elapsed) {
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  printf("%-12s %8.0f frames/s  %8.1f us per frame\n", name, frames / seconds,
+         seconds * 1e6 / frames);
+}
+
+// 60 rows of "name: value" in 4 columns, 5 values change every frame
+constexpr int dashboard_columns = 4;
+constexpr int dashboard_width = columns / dashboard_columns;
+
+std::string dashboard_value(int item, int frame) {
+  return std::to_string((item * 7919 + (item % 48 == frame % 48) * frame) %
+                        100000);
+}
+
+void draw_dashboard(frame_buffer &out, int frame) {
+  out << clear;
+  for (int item = 0; item < rows * dashboard_columns; ++item) {
+    const int x = item % dashboard_columns * dashboard_width;
+    out << set_cursor(static_cast<uint8_t>(item / dashboard_columns + 1),
+                      static_cast<uint8_t>(x + 1))
+        << bold << "metric " << item << ": " << reset << green
+        << dashboard_value(item, frame) << reset;
+  }
+}
+
+void draw_dashboard(screen &out, int frame) {
+  const cell_style label{.fg = {}, .bg = {}, .attributes = attribute::bold};
+  const cell_style value{.fg = color::green, .bg = {}, .attributes = {}};
+  for (int item = 0; item < rows * dashboard_columns; ++item) {
+    const auto x = static_cast<u16>(item % dashboard_columns * dashboard_width);
+    const auto y = static_cast<u16>(item / dashboard_columns);
+    const std::string name = "metric " + std::to_string(item) + ": ";
+    const u16 width = out.put(x, y, name, label);
+    const std::string number = dashboard_value(item, frame);
+    out.fill(static_cast<u16>(x + width), y, dashboard_width - width, 1, {});
+    out.put(static_cast<u16>(x + width), y, number, value);
+  }
+}
+
+// Every row of the table: a bold name, and green values
+template <class Sink> void draw_table(Sink &out, int frame) {
+  for (int y = 0; y < rows; ++y) {
+    out << decorate(bold, "row ") << decorate(bold, y);
+    for (int x = 0; x < 8; ++x) {
+      out << ' ' << decorate(green, (x * y + frame) % 1000);
+    }
+    out << '\n';
+  }
+}
+
+void report_bytes(const char *name, clock_type::duration elapsed,
+                  size_t bytes) {
+  const double seconds = std::chrono::duration<double>(elapsed).count();
+  printf("%-12s %8.0f frames/s  %8zu bytes per frame\n", name,
+         frames / seconds, bytes / frames);
+}
+
+} // namespace
+
+int main() {
+  {
+    std::ofstream out{"/dev/null"};
+    const auto start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      draw(out, i);
+      out.flush();
+    }
+    const auto elapsed = clock_type::now() - start;
+    report("ostream", elapsed);
+  }
+
+  {
+    const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+      perror("output");
+      return 1;
+    }
+    frame_buffer out;
+    const auto start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      draw(out, i);
+      out.flush(fd);
+    }
+    const auto elapsed = clock_type::now() - start;
+    report("frame_buffer", elapsed);
+
+    size_t bytes = 0;
+    auto dashboard_start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      draw_dashboard(out, i);
+      bytes += out.size();
+      out.flush(fd);
+    }
+    report_bytes("full redraw", clock_type::now() - dashboard_start, bytes);
+
+    screen dashboard{columns, rows};
+    bytes = 0;
+    dashboard_start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      draw_dashboard(dashboard, i);
+      dashboard.render(out);
+      bytes += out.size();
+      out.flush(fd);
+    }
+    report_bytes("screen", clock_type::now() - dashboard_start, bytes);
+
+    bytes = 0;
+    auto table_start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      draw_table(out, i);
+      bytes += out.size();
+      out.flush(fd);
+    }
+    report_bytes("table", clock_type::now() - table_start, bytes);
+
+    bytes = 0;
+    table_start = clock_type::now();
+    for (int i = 0; i < frames; ++i) {
+      {
+        style_writer styled{out};
+        draw_table(styled, i);
+      }
+      bytes += out.size();
+      out.flush(fd);
+    }
+    report_bytes("style_writer", clock_type::now() - table_start, bytes);
+    close(fd);
+  }
+}
@@ -0,0 +1,99 @@
+// Measure how a single reactor copes with many terminal sessions. Every
+// session reads the slave side of its own pseudo terminal, and keystrokes are
+// written to all the master sides in rounds, so that every session has input
+// to process on every wakeup.
+
+#include "reactor.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <string_view>
+#include <vector>
+
+extern "C" {
+#include <pty.h>
+#include <sys/resource.h>
+}
+
+namespace {
+
+using namespace dpsg;
+
+// 7 events: 5 letters, an arrow key and a modified arrow key
+constexpr std::string_view pattern = "hello\033[A\033[1;5C";
+constexpr size_t events_per_pattern = 7;
+constexpr size_t rounds = 64;
+
+struct pty {
+  int master;
+  int slave;
+};
+
+// Returns false if the pseudo terminals couldn't be created
+bool run(size_t count) {
+  std::vector<pty> ptys;
+  ptys.reserve(count);
+  bool opened = true;
+  while (ptys.size() < count) {
+    pty p;
+    if (openpty(&p.master, &p.slave, nullptr, nullptr, nullptr) == -1) {
+      opened = false;
+      break;
+    }
+    ptys.push_back(p);
+  }
+
+  if (opened) {
+    size_t received = 0;
+    reactor loop;
+    std::deque<terminal_session<>> sessions;
+    for (auto p : ptys) {
+      auto &session = sessions.emplace_back(p.slave, p.slave);
+      loop.add_session(session, [&received](event, std::string_view) {
+        ++received;
+      });
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) {
+      for (auto p : ptys) {
+        write(p.master, pattern.data(), pattern.size());
+      }
+      const size_t expected = (round + 1) * events_per_pattern * count;
+      while (received < expected) {
+        loop.run_once();
+      }
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+
+    printf("%5zu sessions: %10.0f events/s, %8.2f us per round\n", count,
+           static_cast<double>(received) / elapsed.count(),
+           elapsed.count() * 1e6 / rounds);
+  }
+
+  for (auto p : ptys) {
+    close(p.master);
+    close(p.slave);
+  }
+  return opened;
+}
+
+} // namespace
+
+int main() {
+  // Every session needs a pty pair and an escape timer
+  rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  for (size_t count : {1, 16, 256, 1024}) {
+    if (!run(count)) {
+      fprintf(stderr, "could not open %zu pseudo terminals\n", count);
+      break;
+    }
+  }
+}
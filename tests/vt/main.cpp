@@ -1,6 +1,7 @@
 #include "vt100.hpp"
 
 #define DPSG_COMPILE_LINUX_TERM
+#include "keymap.hpp"
 #include "linux_term.hpp"
 
 #include <iostream>
@@ -12,6 +13,7 @@ void process_inputs(auto &ctx) {
   std::cout << red << "Hello VT World!" << reset << '\n' << std::flush;
   auto input = ctx.input_stream();
   auto mouse_enabled = ctx.enable_mouse_tracking();
+  auto paste_enabled = ctx.enable_bracketed_paste();
   while (input) {
     char in = input();
 
@@ -32,80 +34,41 @@ void process_inputs(auto &ctx) {
 std::string print_code(dpsg::event::key key) {
   std::stringstream iss;
   using namespace dpsg::term_events;
-  if (key.same_key(arrow_up)) {
-    return "<UP>";
-  }
-  if (key.same_key(arrow_left)) {
-    return "<LEFT>";
-  }
-  if (key.same_key(arrow_down)) {
-    return "<DOWN>";
-  }
-  if (key.same_key(arrow_right)) {
-    return "<RIGHT>";
-  }
-  if (key.same_key(f1)) {
-    return "<F1>";
-  }
-  if (key.same_key(f2)) {
-    return "<F2>";
-  }
-  if (key.same_key(f3)) {
-    return "<F3>";
-  }
-  if (key.same_key(f4)) {
-    return "<F4>";
-  }
-  if (key.same_key(f5)) {
-    return "<F5>";
-  }
-  if (key.same_key(f6)) {
-    return "<F6>";
-  }
-  if (key.same_key(f7)) {
-    return "<F7>";
-  }
-  if (key.same_key(f8)) {
-    return "<F8>";
-  }
-  if (key.same_key(f9)) {
-    return "<F9>";
-  }
-  if (key.same_key(f10)) {
-    return "<F10>";
-  }
-  if (key.same_key(f11)) {
-    return "<F11>";
-  }
-  if (key.same_key(f12)) {
-    return "<F12>";
-  }
-  if (key == enter) {
-    return "<CR>";
-  }
-  if (key.same_key(backspace)) {
-    return "<BS>";
-  }
-  if (key.same_key(esc)) {
-    return "<ESC>";
-  }
-  if (key.same_key(ins)) {
-    return "<INS>";
-  }
-  if (key.same_key(del)) {
-    return "<DEL>";
-  }
-  if (key.same_key(page_up)) {
-    return "<PGUP>";
-  }
-  if (key.same_key(page_down)) {
-    return "<PGDWN>";
-  }
-  if (key.same_key(home)) {
-    return "<HOME>";
-  }
-  if (key.same_key(end)) {
-    return "<END>";
+  constexpr static auto names = dpsg::make_keymap<std::string_view>({
+      {arrow_up, "<UP>"},
+      {arrow_left, "<LEFT>"},
+      {arrow_down, "<DOWN>"},
+      {arrow_right, "<RIGHT>"},
+      {f1, "<F1>"},
+      {f2, "<F2>"},
+      {f3, "<F3>"},
+      {f4, "<F4>"},
+      {f5, "<F5>"},
+      {f6, "<F6>"},
+      {f7, "<F7>"},
+      {f8, "<F8>"},
+      {f9, "<F9>"},
+      {f10, "<F10>"},
+      {f11, "<F11>"},
+      {f12, "<F12>"},
+      {enter, "<CR>"},
+      {backspace, "<BS>"},
+      {esc, "<ESC>"},
+      {ins, "<INS>"},
+      {del, "<DEL>"},
+      {page_up, "<PGUP>"},
+      {page_down, "<PGDWN>"},
+      {home, "<HOME>"},
+      {end, "<END>"},
+  });
+  // Enter is Ctrl+J, the other names don't depend on the modifiers
+  const dpsg::event::key unmodified{
+      key.code, key.mods & dpsg::event::key::modifiers::Special};
+  if (const auto *name = names.find(key)) {
+    return std::string{*name};
+  }
+  if (const auto *name = names.find(unmodified)) {
+    return std::string{*name};
   }
   if (key.is_unicode()) {
     iss << dpsg::vt100::magenta << key.code_points() << (dpsg::vt100::white | dpsg::vt100::bold);
@@ -128,6 +91,14 @@ void print_mouse(dpsg::event::mouse in) {
                            (int)in.x, (int)in.y);
 }
 
+void print_error(dpsg::event::error in) {
+  using namespace dpsg::vt100;
+  std::cout << red
+            << std::format("Invalid sequence: reason {}, character {}\n",
+                           (int)in.reason, (int)in.character)
+            << reset;
+}
+
 void process_events(auto &ctx) {
   using namespace dpsg;
   using namespace dpsg::vt100;
@@ -135,42 +106,39 @@ void process_events(auto &ctx) {
   std::cout << ( red | bold ) << "Hello VT World!" << reset << '\n' << std::flush;
   auto input = ctx.event_stream();
   auto mouse_enabled = ctx.enable_mouse_tracking();
-  try {
-    while (input) {
-      auto [in, buffer] = input();
-      std::cout << cyan << std::format("Buffer (size: {}):\t", buffer.size());
-      for (char c : buffer) {
-        if (isprint(c) != 0) {
-          std::cout.put(c);
-        } else {
-          std::cout << red << '<' << (int)c << '>' << reset;
-        }
-      }
-      std::cout << '\n' << (bold | white);
-
-      if (in.is_key_event()) {
-        print_key(in.get_key());
-      } else if (in.is_mouse_event()) {
-        print_mouse(in.get_mouse());
-      }
-
-      if (in == ctrl + 'd') {
-        return;
+  auto paste_enabled = ctx.enable_bracketed_paste();
+  while (input) {
+    auto [in, buffer] = input();
+    std::cout << cyan << std::format("Buffer (size: {}):\t", buffer.size());
+    for (char c : buffer) {
+      if (isprint(c) != 0) {
+        std::cout.put(c);
+      } else {
+        std::cout << red << '<' << (int)c << '>' << reset;
       }
+    }
+    std::cout << '\n' << (bold | white);
 
-      std::cout << reset << std::flush;
+    if (in.is_error_event()) {
+      print_error(in.get_error());
+    } else if (in.is_resize_event()) {
+      const auto size = ctx.terminal_size();
+      std::cout << std::format("Resize: {}x{}\n", size.col, size.row);
+    } else if (in.is_paste_event()) {
+      std::cout << std::format("Paste{}: \"{}\"\n",
+                               in.is_partial_paste_event() ? " (part)" : "",
+                               ctx.pasted_text());
+    } else if (in.is_key_event()) {
+      print_key(in.get_key());
+    } else if (in.is_mouse_event()) {
+      print_mouse(in.get_mouse());
     }
-  } catch (invalid_sequence &err) {
-    std::cerr << red << err.what();
-    std::cerr << "\nBuffer was: ";
-    for (auto c : err.buffer()) {
-      if (isprint(c)) {
-        std::cerr << yellow << c;
-      } else {
-        std::cerr << setf(240, 95, 0) << '<' << (int)c << '>';
-      }
+
+    if (in == ctrl + 'd') {
+      return;
     }
-    std::cerr << reset << "\n";
+
+    std::cout << reset << std::flush;
   }
 }
 
@@ -0,0 +1,185 @@
+// Check that consuming events from event_view_stream() and
+// batched_event_stream() never touches the heap, pastes spanning several
+// reads included. The streams read from a pseudo terminal so that the test
+// doesn't need an interactive session.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "linux_term.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+extern "C" {
+#include <pty.h>
+}
+
+static size_t allocation_count = 0;
+
+void *operator new(size_t size) {
+  ++allocation_count;
+  if (void *p = malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t /*size*/) noexcept { free(p); }
+
+namespace {
+
+// 9 events per repetition: 5 letters, an arrow key, a mouse motion, a
+// unicode character and a modified arrow key.
+constexpr std::string_view pattern =
+    "hello\033[A\033[<35;10;20M\xc3\xa9\033[1;5C";
+constexpr size_t events_per_pattern = 9;
+constexpr size_t repetitions = 64;
+constexpr size_t expected_events = events_per_pattern * repetitions;
+
+// Pastes much longer than the read buffer of the streams
+constexpr size_t paste_size = 1000;
+constexpr size_t pastes = 3;
+
+int master_fd = -1;
+
+void send_input() {
+  std::string input;
+  for (size_t i = 0; i < repetitions; ++i) {
+    input += pattern;
+  }
+  write(master_fd, input.data(), input.size());
+}
+
+void send_pastes() {
+  std::string input;
+  for (size_t i = 0; i < pastes; ++i) {
+    input += "\033[200~";
+    input.append(paste_size, 'p');
+    input += "\033[201~";
+  }
+  write(master_fd, input.data(), input.size());
+}
+
+int check(const char *name, size_t allocations, size_t events) {
+  if (events != expected_events) {
+    fprintf(stderr, "%s: expected %zu events, got %zu\n", name,
+            expected_events, events);
+    return 1;
+  }
+  if (allocations != 0) {
+    fprintf(stderr, "%s: %zu allocations for %zu events\n", name, allocations,
+            events);
+    return 1;
+  }
+  return 0;
+}
+
+int test_event_view_stream(dpsg::raw_mode_context &ctx) {
+  auto stream = ctx.event_view_stream<4096, -1>();
+  send_input();
+
+  allocation_count = 0;
+  size_t events = 0;
+  size_t characters = 0;
+  while (events < expected_events && stream) {
+    auto [ev, sequence] = stream();
+    characters += sequence.size();
+    ++events;
+  }
+  auto allocations = allocation_count;
+
+  if (characters != pattern.size() * repetitions) {
+    fprintf(stderr, "event_view_stream: sequences cover %zu characters\n",
+            characters);
+    return 1;
+  }
+  return check("event_view_stream", allocations, events);
+}
+
+int test_batched_event_stream(dpsg::raw_mode_context &ctx) {
+  dpsg::event storage[32];
+  auto stream = ctx.batched_event_stream<4096, -1>(storage);
+  send_input();
+
+  allocation_count = 0;
+  size_t events = 0;
+  while (events < expected_events && stream) {
+    events += stream().size();
+  }
+  return check("batched_event_stream", allocation_count, events);
+}
+
+int check_pastes(const char *name, size_t allocations, size_t characters) {
+  if (characters != paste_size * pastes) {
+    fprintf(stderr, "%s: pastes cover %zu characters\n", name, characters);
+    return 1;
+  }
+  if (allocations != 0) {
+    fprintf(stderr, "%s: %zu allocations for %zu pastes\n", name,
+            allocations, pastes);
+    return 1;
+  }
+  return 0;
+}
+
+int test_event_view_stream_paste(dpsg::raw_mode_context &ctx) {
+  auto stream = ctx.event_view_stream<32, -1>();
+  send_pastes();
+
+  allocation_count = 0;
+  size_t done = 0;
+  size_t characters = 0;
+  while (done < pastes && stream) {
+    auto [ev, sequence] = stream();
+    if (ev.is_paste_event()) {
+      characters += ctx.pasted_text().size();
+      done += ev.is_partial_paste_event() ? 0 : 1;
+    }
+  }
+  return check_pastes("event_view_stream paste", allocation_count,
+                      characters);
+}
+
+int test_batched_event_stream_paste(dpsg::raw_mode_context &ctx) {
+  dpsg::event storage[32];
+  auto stream = ctx.batched_event_stream<32, -1>(storage);
+  send_pastes();
+
+  allocation_count = 0;
+  size_t done = 0;
+  size_t characters = 0;
+  while (done < pastes && stream) {
+    auto events = stream();
+    // A batch ends with a paste event, the text is only valid until then
+    if (!events.empty() && events.back().is_paste_event()) {
+      characters += ctx.pasted_text().size();
+      done += events.back().is_partial_paste_event() ? 0 : 1;
+    }
+  }
+  return check_pastes("batched_event_stream paste", allocation_count,
+                      characters);
+}
+
+} // namespace
+
+int main() {
+  int slave_fd = -1;
+  if (openpty(&master_fd, &slave_fd, nullptr, nullptr, nullptr) == -1) {
+    perror("openpty");
+    return 1;
+  }
+  dup2(slave_fd, STDIN_FILENO);
+  dup2(slave_fd, STDOUT_FILENO);
+
+  int failures = dpsg::with_raw_mode([](dpsg::raw_mode_context &ctx) {
+    return test_event_view_stream(ctx) + test_batched_event_stream(ctx) +
+           test_event_view_stream_paste(ctx) +
+           test_batched_event_stream_paste(ctx);
+  });
+
+  if (failures == 0) {
+    fprintf(stderr, "allocations: OK\n");
+  }
+  return failures;
+}
@@ -0,0 +1,147 @@
+// Check that input_thread hands every event over in order through its ring,
+// many more than the ring holds, with the consumer falling behind now and
+// then, and that it joins cleanly whether it waits for input or for room in
+// the ring. The thread reads from a pseudo terminal so that the test doesn't
+// need an interactive session.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "input_thread.hpp"
+#include "linux_term.hpp"
+#include "spsc_ring.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <string>
+#include <thread>
+
+extern "C" {
+#include <pty.h>
+}
+
+namespace {
+
+constexpr size_t capacity = 16;
+constexpr size_t total_events = 20000;
+
+using context = dpsg::raw_mode_context;
+using thread =
+    dpsg::input_thread<ISIG | ECHO | ICANON, dpsg::input_parser,
+                       dpsg::no_input_latency, capacity>;
+
+int master_fd = -1;
+
+char nth_key(size_t n) { return static_cast<char>('a' + (n % 26)); }
+
+// Write the keys from another thread, the pseudo terminal holds less than
+// the test sends
+std::thread send_keys(size_t count) {
+  return std::thread{[count] {
+    std::string input;
+    for (size_t i = 0; i < count; ++i) {
+      input += nth_key(i);
+    }
+    size_t written = 0;
+    while (written < input.size()) {
+      const auto size =
+          write(master_fd, input.data() + written, input.size() - written);
+      if (size <= 0) {
+        return;
+      }
+      written += static_cast<size_t>(size);
+    }
+  }};
+}
+
+int test_ring() {
+  dpsg::spsc_ring<int, 4> ring;
+  const int items[] = {1, 2, 3, 4, 5, 6};
+  int out[6] = {};
+  int failures = 0;
+  if (ring.push(items) != 4 || ring.try_push(7)) {
+    fprintf(stderr, "spsc_ring: pushed more than its capacity\n");
+    ++failures;
+  }
+  // Wrap around the end of the storage
+  if (ring.pop({out, 3}) != 3 || ring.push({items + 4, 2}) != 2 ||
+      ring.pop({out + 3, 3}) != 3) {
+    fprintf(stderr, "spsc_ring: wrong counts around the end\n");
+    ++failures;
+  }
+  const int expected[] = {1, 2, 3, 4, 5, 6};
+  if (!std::equal(std::begin(out), std::end(out), std::begin(expected)) ||
+      !ring.empty()) {
+    fprintf(stderr, "spsc_ring: items out of order\n");
+    ++failures;
+  }
+  return failures;
+}
+
+int test_order(context &ctx) {
+  thread input{ctx};
+  auto sender = send_keys(total_events);
+
+  size_t received = 0;
+  int failures = 0;
+  dpsg::event events[capacity / 2];
+  while (received < total_events && failures == 0) {
+    const size_t count = input.wait(events, 5000);
+    if (count == 0) {
+      fprintf(stderr, "input_thread: timed out after %zu events\n",
+              received);
+      ++failures;
+      break;
+    }
+    for (size_t i = 0; i < count; ++i, ++received) {
+      if (events[i] != dpsg::event::key{nth_key(received)}) {
+        fprintf(stderr, "input_thread: event %zu out of order\n", received);
+        ++failures;
+        break;
+      }
+    }
+    // Fall behind so that the input thread fills the ring and waits
+    if (received % 4000 < count) {
+      std::this_thread::sleep_for(std::chrono::milliseconds{20});
+    }
+  }
+  sender.join();
+  // Joins while the input thread waits for input
+  return failures;
+}
+
+int test_join_when_full(context &ctx) {
+  auto sender = send_keys(capacity * 4);
+  {
+    thread input{ctx};
+    // Let it fill the ring and wait for room that never comes
+    std::this_thread::sleep_for(std::chrono::milliseconds{50});
+  }
+  sender.join();
+  // Drop what the input thread didn't read
+  tcflush(STDIN_FILENO, TCIFLUSH);
+  return 0;
+}
+
+} // namespace
+
+int main() {
+  int slave_fd = -1;
+  if (openpty(&master_fd, &slave_fd, nullptr, nullptr, nullptr) == -1) {
+    perror("openpty");
+    return 1;
+  }
+  dup2(slave_fd, STDIN_FILENO);
+  dup2(slave_fd, STDOUT_FILENO);
+  // A join that hangs fails the test instead of blocking it
+  alarm(30);
+
+  int failures = test_ring() + dpsg::with_raw_mode([](context &ctx) {
+                   return test_order(ctx) + test_join_when_full(ctx);
+                 });
+
+  if (failures == 0) {
+    fprintf(stderr, "input_thread: OK\n");
+  }
+  return failures;
+}
@@ -0,0 +1,93 @@
+// Check that collapsing key repeats in event_view_stream() doesn't disturb
+// the event read past the repeats: a paste starting right after them and
+// going on in the next read keeps its text. The stream reads from a pseudo
+// terminal so that the test doesn't need an interactive session.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "linux_term.hpp"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+extern "C" {
+#include <pty.h>
+}
+
+namespace {
+
+constexpr std::string_view first_read = "aa\033[200~xyz";
+constexpr std::string_view second_read = "123\033[201~q";
+
+int master_fd = -1;
+
+template <class Parser> int test(const char *name) {
+  using context = dpsg::raw_mode_context_basic<ISIG | ECHO | ICANON, Parser>;
+  context ctx;
+  ctx.collapse_key_repeats(true);
+  auto stream = ctx.template event_view_stream<64, -1>();
+
+  std::string got;
+  std::string pasted;
+  const auto describe = [&](dpsg::event ev) {
+    if (ev.is_paste_event()) {
+      pasted += ctx.pasted_text();
+      if (!ev.is_partial_paste_event()) {
+        got += "paste '" + pasted + "' ";
+      }
+    } else if (ev.is_key_event()) {
+      got += std::string{"key '"} + ev.get_key().code + "' repeated " +
+             std::to_string(ev.get_key().repeats) + " ";
+    } else {
+      got += "other ";
+    }
+  };
+
+  // The second part is only written once the first one is read, so that
+  // the paste spans two reads
+  write(master_fd, first_read.data(), first_read.size());
+  while (stream) {
+    auto [ev, sequence] = stream();
+    describe(ev);
+    if (ev.is_partial_paste_event()) {
+      break;
+    }
+  }
+  write(master_fd, second_read.data(), second_read.size());
+  while (stream) {
+    auto [ev, sequence] = stream();
+    describe(ev);
+    if (ev.is_key_event() && ev.get_key().code == 'q') {
+      break;
+    }
+  }
+
+  const std::string expected = "key 'a' repeated 1 paste 'xyz123' key 'q' "
+                               "repeated 0 ";
+  if (got != expected) {
+    fprintf(stderr, "%s: expected %s\n  got %s\n", name, expected.c_str(),
+            got.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main() {
+  int slave_fd = -1;
+  if (openpty(&master_fd, &slave_fd, nullptr, nullptr, nullptr) == -1) {
+    perror("openpty");
+    return 1;
+  }
+  dup2(slave_fd, STDIN_FILENO);
+  dup2(slave_fd, STDOUT_FILENO);
+
+  int failures = test<dpsg::input_parser>("input_parser") +
+                 test<dpsg::table_input_parser>("table_input_parser");
+
+  if (failures == 0) {
+    fprintf(stderr, "key_repeats: OK\n");
+  }
+  return failures;
+}
@@ -0,0 +1,356 @@
+// Check the events input_parser and table_input_parser read from known
+// inputs, however the input is split between reads. Every input is fed
+// whole, in two parts at every byte boundary, and one byte at a time, to
+// both parsers. Each time, the events must be the expected ones, and the
+// characters reported for them those reported when the input is read whole.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "linux_term.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using dpsg::event;
+using dpsg::term_position;
+using namespace dpsg::term_events;
+using mods = event::key::modifiers;
+using reasons = event::error::reasons;
+
+// An event, the text of a paste, and the position of a cursor report
+struct expected {
+  event ev;
+  std::string text{};
+  term_position position{};
+
+  template <class Event> expected(Event e) : ev{e} {}
+  expected(char c) : ev{event::key{c}} {}
+  expected(event e, std::string pasted) : ev{e}, text{std::move(pasted)} {}
+  expected(event e, term_position at) : ev{e}, position{at} {}
+
+  bool operator==(const expected &other) const {
+    return ev == other.ev && text == other.text &&
+           position.x == other.position.x && position.y == other.position.y;
+  }
+};
+
+event::key with_kind(event::key key, event::key::kinds kind) {
+  key.kind = kind;
+  return key;
+}
+
+// A character of several bytes, given in UTF-8
+event::key unicode(std::string_view c) {
+  event::key key{c[0], mods::Unicode};
+  std::copy(c.begin() + 1, c.end(), key.cont);
+  return key;
+}
+
+// An SGR mouse event: `code` holds the button, the modifiers, and 32 for
+// releases ('m') and motion ('M')
+event mouse(u8 code, u16 x, u16 y, bool motion = false) {
+  event::mouse m{static_cast<event::mouse::modifiers>(code), {.x = x, .y = y}};
+  m.motion = motion;
+  return m;
+}
+
+expected paste(std::string text) {
+  return {event::paste{}, std::move(text)};
+}
+
+expected cursor_report(u16 x, u16 y) {
+  return {event::cursor_report{}, term_position{.x = x, .y = y}};
+}
+
+struct test_case {
+  const char *name;
+  std::string_view input;
+  std::vector<expected> events;
+  // Events read while a cursor position query waits for its answer, if they
+  // differ
+  std::optional<std::vector<expected>> while_querying{};
+};
+
+const test_case cases[] = {
+    {"letters", "hello", {'h', 'e', 'l', 'l', 'o'}},
+    {"control characters",
+     "\x01\t\r\x7f",
+     {ctrl + 'a', ctrl + 'i', ctrl + 'm', backspace}},
+    {"alt", "\033a\033A", {alt + 'a', alt + 'A'}},
+    {"lone escape", "a\033", {'a', esc}},
+    {"arrows",
+     "\033[A\033[B\033[C\033[D",
+     {arrow_up, arrow_down, arrow_right, arrow_left}},
+    {"modified arrows",
+     "\033[1;5A\033[1;2B\033[1;3C\033[1;8D",
+     {ctrl + arrow_up, shift + arrow_down, alt + arrow_right,
+      ctrl + alt + shift + arrow_left}},
+    {"ss3 keys", "\033OP\033OQ\033OR\033OS", {f1, f2, f3, f4}},
+    {"home and end",
+     "\033[H\033[F\033[1;5H\033[1;2F",
+     {home, end, ctrl + home, shift + end}},
+    {"function keys",
+     "\033[2~\033[3;5~\033[15~\033[24;2~\033[5~\033[6~",
+     {ins, ctrl + del, f5, shift + f12, page_up, page_down}},
+    {"utf-8",
+     "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z",
+     {unicode("\xc3\xa9"), unicode("\xe2\x82\xac"),
+      unicode("\xf0\x9f\x98\x80"), 'z'}},
+    {"sgr mouse",
+     "\033[<0;1;1M\033[<0;1;1m\033[<35;10;20M\033[<64;3;4M\033[<16;200;100M",
+     {mouse(0, 1, 1), mouse(32, 1, 1), mouse(35, 10, 20, true),
+      mouse(64, 3, 4), mouse(16, 200, 100)}},
+    {"kitty keys",
+     "\033[97u\033[97;5u\033[97;1:1u\033[97;1:2u\033[97;1:3u"
+     "\033[13u\033[27;3u\033[57399u\033[97:65;2u",
+     {'a', ctrl + 'a', 'a',
+      with_kind(event::key{'a'}, event::key::kinds::Repeat),
+      with_kind(event::key{'a'}, event::key::kinds::Release), enter,
+      alt + esc, extended_key(57399), shift + 'a'}},
+    {"kitty codes out of range",
+     "\033[0u\033[55296u\033[1114112u\033[4294967295u\033[4294967393u"
+     "\033[1114111u",
+     {event::error{reasons::invalid_parameters, 'u'},
+      event::error{reasons::invalid_parameters, 'u'},
+      event::error{reasons::invalid_parameters, 'u'},
+      event::error{reasons::invalid_parameters, 'u'},
+      event::error{reasons::invalid_parameters, 'u'},
+      unicode("\xf4\x8f\xbf\xbf")}},
+    {"kitty legacy keys",
+     "\033[1;5:3A\033[3;1:2~\033[1;2:1H",
+     {with_kind(ctrl + arrow_up, event::key::kinds::Release),
+      with_kind(del, event::key::kinds::Repeat), shift + home}},
+    {"paste",
+     "a\033[200~hello\r\nworld\033[201~b",
+     {'a', paste("hello\r\nworld"), 'b'}},
+    {"empty paste", "\033[200~\033[201~", {paste("")}},
+    {"paste with escapes",
+     "\033[200~\033[A\033[20\033[201\033\033[201~\033[200~\033\033[201~",
+     {paste("\033[A\033[20\033[201\033"), paste("\033")}},
+    {"paste of utf-8",
+     "\033[200~\xc3\xa9\xe2\x82\xac\033[201~\xc3\xa9",
+     {paste("\xc3\xa9\xe2\x82\xac"), unicode("\xc3\xa9")}},
+    {"cursor report",
+     "\033[12;40R\033[3;1R",
+     {cursor_report(40, 12), cursor_report(1, 3)}},
+    {"cursor report on the first row",
+     "\033[1;5R\033[1;1R",
+     {ctrl + f3, f3},
+     std::vector<expected>{cursor_report(5, 1), cursor_report(1, 1)}},
+    {"malformed sequences",
+     "\033[99~\033[<35;10M\033[1;5x",
+     {event::key{99, mods::Special},
+      event::error{reasons::invalid_parameters, 'M'},
+      event::error{reasons::unfinished_numeric_sequence, 'x'}}},
+    {"sequence broken by escape",
+     "\033[1;5\033[Ax",
+     {event::error{reasons::unfinished_numeric_sequence, '\033'}, arrow_up,
+      'x'}},
+    {"too many parameters",
+     "\033[1;2;3;4;5;6Ab",
+     {event::error{reasons::invalid_parameters, ';'}, 'b'}},
+    {"unfinished sequence skipped to its end",
+     "\033[1;5$!ya",
+     {event::error{reasons::unfinished_numeric_sequence, '$'}, 'a'}},
+    {"interleaved",
+     "a\033[<35;1;2M\xc3\xa9\033[200~p\033[201~\033[97;5u\033[7;9R\033OQ"
+     "\033[1;5R",
+     {'a', mouse(35, 1, 2, true), unicode("\xc3\xa9"), paste("p"),
+      ctrl + 'a', cursor_report(9, 7), f2, ctrl + f3},
+     std::vector<expected>{'a', mouse(35, 1, 2, true), unicode("\xc3\xa9"),
+                           paste("p"), ctrl + 'a', cursor_report(9, 7), f2,
+                           cursor_report(5, 1)}},
+};
+
+// What the parser reads: the events, and the characters reported for them
+struct reading {
+  std::vector<expected> events;
+  std::vector<std::string> sequences;
+  std::string paste; // Parts of a paste read so far
+
+  template <class Parser> void record(const Parser &parser, event ev) {
+    if (ev.is_paste_event()) {
+      paste += parser.last_sequence();
+      if (!ev.is_partial_paste_event()) {
+        events.push_back(::paste(std::exchange(paste, {})));
+        sequences.emplace_back();
+      }
+      return;
+    }
+    if (ev.is_cursor_report_event()) {
+      events.emplace_back(ev, parser.cursor_position());
+    } else {
+      events.emplace_back(ev);
+    }
+    sequences.emplace_back(parser.last_sequence());
+  }
+};
+
+template <class Parser>
+void parse(Parser &parser, reading &out, std::string_view input) {
+  std::span<const char> rest{input.data(), input.size()};
+  event ev;
+  while (!rest.empty()) {
+    auto [consumed, events] = parser.parse(rest, {&ev, 1});
+    rest = rest.subspan(consumed);
+    if (events != 0) {
+      out.record(parser, ev);
+    }
+  }
+}
+
+// Read `input` fed in parts ending at each of `splits`, then flush the
+// parser as if no more input came
+template <class Parser>
+reading read(std::string_view input, const std::vector<size_t> &splits,
+             bool querying) {
+  Parser parser;
+  parser.expect_cursor_report(querying);
+  reading out;
+  size_t first = 0;
+  for (size_t last : splits) {
+    parse(parser, out, input.substr(first, last - first));
+    first = last;
+  }
+  parse(parser, out, input.substr(first));
+  event ev;
+  if (parser.flush({&ev, 1}) != 0) {
+    out.record(parser, ev);
+  }
+  if (parser.pending()) {
+    out.events.emplace_back(event::error{{}, 0});
+    out.sequences.emplace_back("pending");
+  }
+  return out;
+}
+
+std::string printable(std::string_view text) {
+  std::string result;
+  for (char c : text) {
+    if (static_cast<unsigned char>(c) < 0x20 || c == 0x7f) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\x%02x",
+               static_cast<unsigned char>(c));
+      result += buffer;
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+std::string describe(const expected &e) {
+  char buffer[64];
+  snprintf(buffer, sizeof(buffer), "%016llx",
+           static_cast<unsigned long long>(e.ev._cheat_));
+  std::string result = buffer;
+  if (e.ev.is_paste_event()) {
+    result += " '" + printable(e.text) + "'";
+  } else if (e.ev.is_cursor_report_event()) {
+    snprintf(buffer, sizeof(buffer), " at %u,%u", e.position.x,
+             e.position.y);
+    result += buffer;
+  }
+  return result;
+}
+
+void report(const char *parser, const test_case &test, bool querying,
+            const std::vector<size_t> &splits,
+            const std::vector<std::string> &expected,
+            const std::vector<std::string> &got) {
+  fprintf(stderr, "%s: %s%s, split at", parser, test.name,
+          querying ? " (expecting a cursor report)" : "");
+  for (size_t split : splits) {
+    fprintf(stderr, " %zu", split);
+  }
+  fprintf(stderr, "\n");
+  for (size_t i = 0; i < std::max(expected.size(), got.size()); ++i) {
+    const std::string none = "-";
+    const auto &e = i < expected.size() ? expected[i] : none;
+    const auto &g = i < got.size() ? got[i] : none;
+    fprintf(stderr, "  %s %s | %s\n", e == g ? " " : "!", e.c_str(),
+            g.c_str());
+  }
+}
+
+std::vector<std::string> describe(const std::vector<expected> &events) {
+  std::vector<std::string> result;
+  for (const auto &e : events) {
+    result.push_back(describe(e));
+  }
+  return result;
+}
+
+std::vector<std::string> printable(const std::vector<std::string> &texts) {
+  std::vector<std::string> result;
+  for (const auto &text : texts) {
+    result.push_back(printable(text));
+  }
+  return result;
+}
+
+template <class Parser>
+int check(const char *name, const test_case &test, bool querying,
+          const std::vector<size_t> &splits,
+          const std::vector<expected> &events,
+          const std::vector<std::string> &sequences) {
+  const auto got = read<Parser>(test.input, splits, querying);
+  if (got.events != events) {
+    report(name, test, querying, splits, describe(events),
+           describe(got.events));
+    return 1;
+  }
+  if (got.sequences != sequences) {
+    report(name, test, querying, splits, printable(sequences),
+           printable(got.sequences));
+    return 1;
+  }
+  return 0;
+}
+
+int test(const test_case &test, bool querying) {
+  const auto &events = querying && test.while_querying.has_value()
+                           ? *test.while_querying
+                           : test.events;
+  const auto sequences =
+      read<dpsg::input_parser>(test.input, {}, querying).sequences;
+
+  std::vector<std::vector<size_t>> splits;
+  for (size_t split = 0; split <= test.input.size(); ++split) {
+    splits.push_back({split});
+  }
+  std::vector<size_t> every_byte;
+  for (size_t split = 1; split < test.input.size(); ++split) {
+    every_byte.push_back(split);
+  }
+  splits.push_back(every_byte);
+
+  int failures = 0;
+  for (const auto &s : splits) {
+    failures += check<dpsg::input_parser>("input_parser", test, querying, s,
+                                          events, sequences);
+    failures += check<dpsg::table_input_parser>(
+        "table_input_parser", test, querying, s, events, sequences);
+  }
+  return failures;
+}
+
+} // namespace
+
+int main() {
+  int failures = 0;
+  for (const auto &c : cases) {
+    failures += test(c, false) + test(c, true);
+  }
+
+  if (failures == 0) {
+    fprintf(stderr, "parsers: OK\n");
+  }
+  return failures;
+}
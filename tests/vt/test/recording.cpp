@@ -0,0 +1,175 @@
+// Check that a recording made by input_recorder replays as the same events
+// in the same order: keys, pastes longer than 127 bytes, delays long enough
+// to take several bytes as varints, and resizes. The input comes from a
+// pseudo terminal, the controlling terminal of the test so that resizes
+// signal it.
+
+#define DPSG_COMPILE_LINUX_TERM
+#include "linux_term.hpp"
+#include "recording.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <pty.h>
+#include <sys/wait.h>
+}
+
+namespace {
+
+using namespace std::chrono_literals;
+
+int master_fd = -1;
+
+// What the user does: type, paste, wait and resize the terminal
+void act() {
+  const auto type = [](std::string_view text) {
+    write(master_fd, text.data(), text.size());
+    std::this_thread::sleep_for(5ms);
+  };
+  const auto resize = [](u16 columns, u16 rows) {
+    const winsize size{
+        .ws_row = rows, .ws_col = columns, .ws_xpixel = 0, .ws_ypixel = 0};
+    ioctl(master_fd, TIOCSWINSZ, &size);
+    std::this_thread::sleep_for(5ms);
+  };
+  type("ab");
+  resize(100, 40);
+  type("\033[200~" + std::string(300, 'p') + "\033[201~");
+  std::this_thread::sleep_for(20ms); // A delay of 3 bytes
+  type("\033[A");
+  resize(90, 30);
+  type("\xc3\xa9q");
+}
+
+// Describe the events read until 'q', with the text of pastes and the size
+// of resizes
+std::vector<std::string> read_events(dpsg::raw_mode_context &ctx) {
+  std::vector<std::string> events;
+  std::string paste;
+  auto stream = ctx.event_view_stream<4096, -1>();
+  while (stream) {
+    auto [ev, sequence] = stream();
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%016llx",
+             static_cast<unsigned long long>(ev._cheat_));
+    std::string description = buffer;
+    if (ev.is_paste_event()) {
+      paste += ctx.pasted_text();
+      if (ev.is_partial_paste_event()) {
+        continue;
+      }
+      description += " " + std::exchange(paste, {});
+    } else if (ev.is_resize_event()) {
+      const auto size = ctx.terminal_size();
+      description +=
+          " " + std::to_string(size.col) + "x" + std::to_string(size.row);
+    }
+    events.push_back(description);
+    if (ev == dpsg::event::key{'q'}) {
+      break;
+    }
+  }
+  return events;
+}
+
+int check_records(const dpsg::input_recording &recording) {
+  bool long_delay = false;
+  bool long_read = false;
+  size_t resizes = 0;
+  for (const auto &record : recording.records()) {
+    long_delay = long_delay || record.delay >= 16384us;
+    long_read = long_read || record.bytes.size() >= 128;
+    resizes += record.is_resize() ? 1 : 0;
+  }
+  if (!long_delay || !long_read || resizes != 2) {
+    fprintf(stderr,
+            "recording: %zu records, long delay %d, long read %d, %zu "
+            "resizes\n",
+            recording.records().size(), long_delay, long_read, resizes);
+    return 1;
+  }
+  return 0;
+}
+
+int test(dpsg::raw_mode_context &ctx) {
+  FILE *file = tmpfile();
+  std::vector<std::string> recorded;
+  {
+    dpsg::input_recorder recorder{file};
+    ctx.record_input(&recorder);
+    std::thread user{act};
+    recorded = read_events(ctx);
+    user.join();
+    ctx.record_input(nullptr);
+  }
+
+  rewind(file);
+  dpsg::input_recording recording{file};
+  fclose(file);
+  int failures = check_records(recording);
+
+  FILE *master = fdopen(dup(master_fd), "w");
+  std::thread player{[&] { dpsg::replay(recording, master); }};
+  const auto replayed = read_events(ctx);
+  player.join();
+  fclose(master);
+
+  if (replayed != recorded) {
+    fprintf(stderr, "recording: recorded\n");
+    for (const auto &e : recorded) {
+      fprintf(stderr, "  %s\n", e.c_str());
+    }
+    fprintf(stderr, "replayed\n");
+    for (const auto &e : replayed) {
+      fprintf(stderr, "  %s\n", e.c_str());
+    }
+    ++failures;
+  }
+  return failures;
+}
+
+int run() {
+  // Resizes only signal the foreground process group of a controlling
+  // terminal, the test needs a session of its own
+  if (setsid() == -1) {
+    perror("setsid");
+    return 1;
+  }
+  int slave_fd = -1;
+  if (openpty(&master_fd, &slave_fd, nullptr, nullptr, nullptr) == -1) {
+    perror("openpty");
+    return 1;
+  }
+  if (ioctl(slave_fd, TIOCSCTTY, 0) == -1) {
+    perror("TIOCSCTTY");
+    return 1;
+  }
+  dup2(slave_fd, STDIN_FILENO);
+  dup2(slave_fd, STDOUT_FILENO);
+  alarm(30);
+
+  return dpsg::with_raw_mode(test);
+}
+
+} // namespace
+
+int main() {
+  const pid_t child = fork();
+  if (child == 0) {
+    _exit(run());
+  }
+  int status = 0;
+  if (child == -1 || waitpid(child, &status, 0) == -1 ||
+      !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    return 1;
+  }
+  fprintf(stderr, "recording: OK\n");
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Check the exact bytes screen::render() writes for known frames: the first
+// frame, a single changed cell, a move made by writing unchanged cells
+// again, writes to the last column with the wrap they leave pending, and
+// control characters drawn in cells.
+
+#include "screen.hpp"
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+namespace {
+
+using namespace dpsg::vt100;
+
+std::string printable(std::string_view text) {
+  std::string result;
+  for (char c : text) {
+    if (static_cast<unsigned char>(c) < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\x%02x",
+               static_cast<unsigned char>(c));
+      result += buffer;
+    } else {
+      result += c;
+    }
+  }
+  return result;
+}
+
+int check(const char *name, screen &s, std::string_view expected) {
+  frame_buffer frame;
+  s.render(frame);
+  if (frame.view() != expected) {
+    fprintf(stderr, "%s: expected %s\n  got %s\n", name,
+            printable(expected).c_str(), printable(frame.view()).c_str());
+    return 1;
+  }
+  return 0;
+}
+
+} // namespace
+
+int main() {
+  int failures = 0;
+  screen s{6, 3};
+
+  s.put(0, 0, "ab");
+  s.put(1, 1, "cd", {.fg = {}, .bg = {}, .attributes = attribute::bold});
+  // Full rows leave the cursor past the last column, CR LF starts the next
+  failures += check("first frame", s,
+                    "\033[H\033[0mab    \r\n \033[1mcd\033[0m   \r\n      ");
+
+  s.put(4, 2, "x");
+  failures += check("one cell", s, "\033[3;5H\033[0mx");
+
+  // Writing "b " again is shorter than moving over it
+  s.put(0, 0, "Z");
+  s.put(3, 0, "Y");
+  failures += check("reprint", s, "\033[H\033[0mZb Y");
+
+  s.put(5, 1, "L");
+  s.put(0, 2, "M");
+  failures += check("last column", s, "\033[2;6H\033[0mL\r\nM");
+
+  // No relative move from past the last column, where terminals differ
+  s.put(5, 0, "P");
+  s.put(2, 1, "Q");
+  failures += check("move from the last column", s,
+                    "\033[1;6H\033[0mP\033[2;3HQ");
+
+  s.put(0, 0, "\n\033\x7f\xc2\x9b");
+  s.set(4, 0, cell{U'\a', {}});
+  s.fill(0, 2, 1, 1, cell{U'\t', {}});
+  constexpr std::string_view replacement = "\xef\xbf\xbd"; // U+FFFD
+  std::string expected = "\033[H\033[0m";
+  for (int i = 0; i < 5; ++i) {
+    expected += replacement;
+  }
+  expected += "\r\n\n";
+  expected += replacement;
+  failures += check("control characters", s, expected);
+
+  if (failures == 0) {
+    fprintf(stderr, "screen: OK\n");
+  }
+  return failures;
+}